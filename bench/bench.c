@@ -0,0 +1,450 @@
+// Benchmark harness for the filesystem commands
+//
+// Drives synthetic workloads through the same functions the FS shell calls and
+// prints one JSON object per (workload, fill level, operation) with throughput
+// and latency percentiles, so results can be diffed between builds.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "../include/headers.h"
+
+#define SMALL_MIN 512
+#define SMALL_MAX 8192
+#define CHURN_FILE_SIZE 65536
+#define LARGE_FILE_SIZE (8 * 1024 * 1024)  //Deep enough into the block maps to need double indirect blocks
+#define MAX_STATS 64
+
+struct stats {
+  const char *workload;
+  uint32_t    fill;
+  const char *op;
+  double     *latency;
+  uint32_t    count, cap;
+  uint32_t    errors;
+  uint64_t    bytes;
+  double      total;
+};
+
+struct stats results[MAX_STATS];
+uint32_t     num_results;
+
+FILE    *report;
+char     format[8] = "json";
+uint64_t rng_state = 88172645463325252ULL;
+
+uint64_t rng()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct stats *getStats(const char *workload, uint32_t fill, const char *op)
+{
+  uint32_t i;
+  for(i = 0; i < num_results; i++)
+    if(strcmp(results[i].workload, workload) == 0 && results[i].fill == fill && strcmp(results[i].op, op) == 0)
+      return &results[i];
+
+  if(num_results == MAX_STATS)
+  {
+    fprintf(stderr, "Error: Too many result series\n");
+    exit(1);
+  }
+
+  struct stats *st = &results[num_results++];
+  memset(st, 0, sizeof(*st));
+  st->workload = workload;
+  st->fill = fill;
+  st->op = op;
+  return st;
+}
+
+//Record one operation that moved bytes, counting it as failed if it reported an error
+void record(struct stats *st, double start, uint64_t bytes, uint32_t errors_before)
+{
+  double elapsed = now() - start;
+
+  if(st->count == st->cap)
+  {
+    st->cap = st->cap ? st->cap * 2 : 256;
+    st->latency = realloc(st->latency, st->cap * sizeof(double));
+  }
+  st->latency[st->count++] = elapsed;
+  st->total += elapsed;
+  st->bytes += bytes;
+  if(error_count != errors_before) st->errors++;
+}
+
+#define TIMED(st, bytes, call)                  \
+  do {                                          \
+    uint32_t errors_before_ = error_count;      \
+    double start_ = now();                      \
+    call;                                       \
+    record((st), start_, (bytes), errors_before_); \
+  } while(0)
+
+int compareDouble(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+double percentile(struct stats *st, double p)
+{
+  uint32_t i = (uint32_t)(p * (st->count - 1) + 0.5);
+  return st->latency[i] * 1e6;
+}
+
+void printResults()
+{
+  uint32_t i;
+  if(strcmp(format, "csv") == 0)
+    fprintf(report, "workload,fill,op,ops,errors,ops_per_sec,mb_per_sec,p50_us,p90_us,p99_us,max_us\n");
+
+  for(i = 0; i < num_results; i++)
+  {
+    struct stats *st = &results[i];
+    if(st->count == 0) continue;
+
+    qsort(st->latency, st->count, sizeof(double), compareDouble);
+
+    double ops = st->total > 0 ? st->count / st->total : 0;
+    double mbs = st->total > 0 ? st->bytes / st->total / (1024.0 * 1024.0) : 0;
+
+    if(strcmp(format, "csv") == 0)
+      fprintf(report, "%s,%u,%s,%u,%u,%.1f,%.2f,%.1f,%.1f,%.1f,%.1f\n",
+              st->workload, st->fill, st->op, st->count, st->errors, ops, mbs,
+              percentile(st, 0.50), percentile(st, 0.90), percentile(st, 0.99),
+              st->latency[st->count - 1] * 1e6);
+    else
+      fprintf(report, "{\"workload\":\"%s\",\"fill\":%u,\"op\":\"%s\",\"ops\":%u,\"errors\":%u,"
+              "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+              "\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+              st->workload, st->fill, st->op, st->count, st->errors, ops, mbs,
+              percentile(st, 0.50), percentile(st, 0.90), percentile(st, 0.99),
+              st->latency[st->count - 1] * 1e6);
+  }
+}
+
+//Write a source file of the given size, half text-like and half random, so files mix repetitive
+//and incompressible data the way real inputs do rather than being all one byte
+void makeSource(char *path, uint32_t size)
+{
+  static const char words[] = "the quick brown fox jumps over the lazy dog 0123456789\n";
+  uint8_t *buf = malloc(size);
+  uint32_t i;
+
+  for(i = 0; i < size / 2; i++)
+    buf[i] = words[(i + (rng() & 3)) % (sizeof(words) - 1)];
+  for(; i < size; i++)
+    buf[i] = rng();
+
+  FILE *out = fopen(path, "w");
+  if(out == NULL)
+  {
+    fprintf(stderr, "Error: Unable to create %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  fwrite(buf, 1, size, out);
+  fclose(out);
+  free(buf);
+}
+
+void freshImage()
+{
+  createfs("bench.img", 0, 0, 0);
+}
+
+//Many small files through every per-file command
+void smallFiles(uint32_t count)
+{
+  const char *w = "small";
+  uint32_t i, *sizes = malloc(count * sizeof(uint32_t));
+  char src[32], name[32];
+  uint8_t key[] = "benchkey";
+
+  freshImage();
+
+  for(i = 0; i < count; i++)
+  {
+    sizes[i] = SMALL_MIN + rng() % (SMALL_MAX - SMALL_MIN);
+    sprintf(src, "src%u", i);
+    makeSource(src, sizes[i]);
+  }
+
+  for(i = 0; i < count && i < sb.max_files; i++)
+  {
+    sprintf(src, "src%u", i);
+    sprintf(name, "s%u", i);
+    TIMED(getStats(w, 0, "insert"), sizes[i], insert(src, name, 0));
+  }
+  count = i;
+
+  TIMED(getStats(w, 0, "df"), 0, df());
+  TIMED(getStats(w, 0, "list"), 0, list("", 0, 0));
+
+  for(i = 0; i < count; i++)
+  {
+    sprintf(name, "s%u", i);
+    TIMED(getStats(w, 0, "retrieve"), sizes[i], retrieve(name, "out"));
+    TIMED(getStats(w, 0, "read"), sizes[i], readData(name, 0, sizes[i], READ_HEX));
+    TIMED(getStats(w, 0, "encrypt"), sizes[i], encryptFile(name, key, sizeof(key) - 1));
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    sprintf(name, "s%u", i);
+    TIMED(getStats(w, 0, "delete"), 0, deleteFile(name));
+  }
+  for(i = 0; i < count; i++)
+  {
+    sprintf(name, "s%u", i);
+    TIMED(getStats(w, 0, "undelete"), 0, undeleteFile(name));
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    sprintf(src, "src%u", i);
+    unlink(src);
+  }
+  free(sizes);
+}
+
+//Files of LARGE_FILE_SIZE, as many as the image holds
+void largeFiles(uint32_t count)
+{
+  const char *w = "large";
+  uint32_t i, fit;
+  char name[32];
+  uint8_t key[] = "k";
+
+  //The geometry is only known once the image is open
+  freshImage();
+  fit = (uint64_t)NUM_DATA_BLOCKS * BLOCK_SIZE / LARGE_FILE_SIZE - 1;
+  if(count > fit) count = fit;
+  makeSource("srcmax", LARGE_FILE_SIZE);
+
+  for(i = 0; i < count; i++)
+  {
+    sprintf(name, "l%u", i);
+    TIMED(getStats(w, 0, "insert"), LARGE_FILE_SIZE, insert("srcmax", name, 0));
+  }
+  for(i = 0; i < count; i++)
+  {
+    sprintf(name, "l%u", i);
+    TIMED(getStats(w, 0, "retrieve"), LARGE_FILE_SIZE, retrieve(name, "out"));
+    TIMED(getStats(w, 0, "encrypt"), LARGE_FILE_SIZE, encryptFile(name, key, 1));
+  }
+  //Hex dumps are slow enough that a handful is representative
+  for(i = 0; i < count && i < 8; i++)
+  {
+    sprintf(name, "l%u", i);
+    TIMED(getStats(w, 0, "read"), LARGE_FILE_SIZE, readData(name, 0, LARGE_FILE_SIZE, READ_HEX));
+  }
+  for(i = 0; i < count; i++)
+  {
+    sprintf(name, "l%u", i);
+    TIMED(getStats(w, 0, "delete"), 0, deleteFile(name));
+  }
+
+  unlink("srcmax");
+}
+
+//Fill the image to a given percentage, then replace random files one at a time
+void churn(uint32_t count, uint32_t fill)
+{
+  const char *w = "churn";
+  uint32_t i, files, next = 0;
+  char name[32];
+
+  //The geometry is only known once the image is open
+  freshImage();
+  makeSource("srcchurn", CHURN_FILE_SIZE);
+
+  uint32_t target = (uint64_t)NUM_DATA_BLOCKS * BLOCK_SIZE / CHURN_FILE_SIZE * fill / 100;
+  if(target > sb.max_files - 1) target = sb.max_files - 1;
+  uint32_t *live = malloc((target + count) * sizeof(uint32_t));
+
+  for(files = 0; files < target; files++)
+  {
+    live[files] = next;
+    sprintf(name, "c%u", next++);
+    insert("srcchurn", name, 0);
+  }
+
+  //Every cycle deletes one file and inserts a new one, after a few
+  //hundred cycles the free space is scattered across the image
+  for(i = 0; i < count; i++)
+  {
+    if(files > 0)
+    {
+      uint32_t victim = rng() % files;
+      sprintf(name, "c%u", live[victim]);
+      TIMED(getStats(w, fill, "delete"), 0, deleteFile(name));
+      live[victim] = live[--files];
+    }
+
+    live[files++] = next;
+    sprintf(name, "c%u", next++);
+    TIMED(getStats(w, fill, "insert"), CHURN_FILE_SIZE, insert("srcchurn", name, 0));
+    TIMED(getStats(w, fill, "retrieve"), CHURN_FILE_SIZE, retrieve(name, "out"));
+  }
+
+  TIMED(getStats(w, fill, "df"), 0, df());
+  TIMED(getStats(w, fill, "list"), 0, list("", 0, 0));
+
+  //Read every file back before and after defrag gathers what the cycles scattered
+  for(i = 0; i < files; i++)
+  {
+    sprintf(name, "c%u", live[i]);
+    TIMED(getStats(w, fill, "retrieve_fragmented"), CHURN_FILE_SIZE, retrieve(name, "out"));
+  }
+  TIMED(getStats(w, fill, "defrag"), 0, defrag(0, 0));
+  for(i = 0; i < files; i++)
+  {
+    sprintf(name, "c%u", live[i]);
+    TIMED(getStats(w, fill, "retrieve_defragged"), CHURN_FILE_SIZE, retrieve(name, "out"));
+  }
+
+  unlink("srcchurn");
+  free(live);
+}
+
+//Whole-image operations: format, open, and a save after a small change
+void imageOps(uint32_t count)
+{
+  const char *w = "image";
+  uint32_t i;
+  char name[32];
+
+  if(count > 20) count = 20;
+
+  for(i = 0; i < count; i++)
+    TIMED(getStats(w, 0, "createfs"), 0, freshImage());
+
+  makeSource("srcimg", 4096);
+  for(i = 0; i < count; i++)
+  {
+    TIMED(getStats(w, 0, "openfs"), (uint64_t)NUM_BLOCKS * BLOCK_SIZE, openfs("bench.img"));
+
+    sprintf(name, "i%u", i);
+    insert("srcimg", name, 0);
+    TIMED(getStats(w, 0, "savefs_small_change"), 4096, savefs());
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    TIMED(getStats(w, 0, "openfs_mmap"), 0, openfs_mmap("bench.img"));
+    sprintf(name, "m%u", i);
+    insert("srcimg", name, 0);
+    TIMED(getStats(w, 0, "savefs_mmap_small_change"), 4096, savefs());
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    TIMED(getStats(w, 0, "openfs_pool"), 0, openfs_pool("bench.img", 1));
+    sprintf(name, "p%u", i);
+    insert("srcimg", name, 0);
+    TIMED(getStats(w, 0, "savefs_pool_small_change"), 4096, savefs());
+  }
+  closefs();
+
+  unlink("srcimg");
+}
+
+void usage(char *prog)
+{
+  fprintf(stderr, "Usage: %s [-w small,large,churn,image] [-n count] [-l fill,...] [-s seed] [-f json|csv]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char workloads[128] = "small,large,churn,image";
+  char fills[128] = "0,50,90";
+  uint32_t count = 200;
+  int opt;
+
+  while((opt = getopt(argc, argv, "w:n:l:s:f:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'w': snprintf(workloads, sizeof(workloads), "%s", optarg); break;
+      case 'n': count = atoi(optarg); break;
+      case 'l': snprintf(fills, sizeof(fills), "%s", optarg); break;
+      case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+      case 'f': snprintf(format, sizeof(format), "%s", optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if(count == 0) usage(argv[0]);
+
+  //Results go to the real stdout, command output is discarded
+  report = fdopen(dup(STDOUT_FILENO), "w");
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+
+  //Batch mode keeps status messages quiet and errors countable
+  batch_mode = 1;
+  error_log = fopen("/dev/null", "w");
+
+  char dir[] = "/tmp/fsbenchXXXXXX";
+  if(mkdtemp(dir) == NULL || chdir(dir) == -1)
+  {
+    fprintf(stderr, "Error: Unable to create a work directory: %s\n", strerror(errno));
+    return 1;
+  }
+
+  init();
+
+  char *w, *save;
+  for(w = strtok_r(workloads, ",", &save); w != NULL; w = strtok_r(NULL, ",", &save))
+  {
+    if(strcmp(w, "small") == 0) smallFiles(count);
+    else if(strcmp(w, "large") == 0) largeFiles(count);
+    else if(strcmp(w, "image") == 0) imageOps(count);
+    else if(strcmp(w, "churn") == 0)
+    {
+      char fill_list[128], *f, *fsave;
+      strcpy(fill_list, fills);
+      for(f = strtok_r(fill_list, ",", &fsave); f != NULL; f = strtok_r(NULL, ",", &fsave))
+        churn(count, atoi(f));
+    }
+    else
+    {
+      fprintf(stderr, "Error: Unknown workload %s\n", w);
+      return 1;
+    }
+    fflush(stdout);
+  }
+
+  if(image_open) closefs();
+  unlink("bench.img");
+  unlink("out");
+  chdir("/");
+  rmdir(dir);
+
+  printResults();
+  fclose(report);
+
+  return 0;
+}
@@ -1,14 +1,213 @@
-void readData(char *file, uint32_t startByte, uint32_t numBytes);
+#ifndef HEADERS_H
+#define HEADERS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// FS related
+#define BLOCKS_PER_FILE 1024  //Block pointers in an inode of images without FS_FEATURE_INDIRECT
+#define DIRECT_BLOCKS 11      //Block pointers in an inode of images with it, before the indirect ones
+#define INDIRECT_LEVELS 3
+
+// Geometry of images made by createfs without options
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_NUM_BLOCKS 65536
+#define DEFAULT_NUM_FILES 256
+
+// Data kept in memory by libfs images opened with FS_IMAGE_POOL
+#define DEFAULT_POOL_SIZE (64 * 1024 * 1024)
+
+// Limits on the geometry createfs accepts
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MAX_NUM_BLOCKS 0x7fffffff
+#define MAX_NUM_FILES 65536
+
+// Superblock magic, "FSSB"
+#define FS_MAGIC 0x42535346
+#define FS_VERSION 1
+
+// Superblock feature bits
+#define FS_FEATURE_DEDUP    0x1  //insert shares blocks with identical contents
+#define FS_FEATURE_REFCOUNT 0x2  //free_blocks may hold reference counts of shared blocks
+#define FS_FEATURE_CRC      0x4  //A CRC32C of every block is kept in a table after the inodes
+#define FS_FEATURE_SNAPSHOT 0x8  //The directory may hold snapshot entries
+#define FS_FEATURE_INDIRECT 0x10 //Inodes reach blocks through blocks of pointers, the directory grows to max_files
+#define FS_FEATURE_DIRS     0x20 //Files are kept in a tree of directories, found through a sorted index table
+#define FS_FEATURES (FS_FEATURE_DEDUP | FS_FEATURE_REFCOUNT | FS_FEATURE_CRC | FS_FEATURE_SNAPSHOT | \
+                     FS_FEATURE_INDIRECT | FS_FEATURE_DIRS)
+
+//Block 0 of an image, describes its geometry and where each table starts
+//Images written before superblocks existed have none, see loadImage
+struct superblock {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t num_blocks;
+  uint32_t num_files;
+  uint32_t blocks_per_file;
+  uint32_t directory_block;
+  uint32_t free_inodes_block;
+  uint32_t free_blocks_block;
+  uint32_t inodes_block;
+  uint32_t first_data_block;
+  uint32_t features;
+  uint32_t crc_block;  //First block of the checksum table, 0 without FS_FEATURE_CRC
+  uint32_t table_crc;  //CRC32C of the checksum table itself
+  uint32_t max_files;  //Files the tables have room for, which num_files grows to with FS_FEATURE_INDIRECT
+  uint32_t index_block;  //First block of the directory index, 0 without FS_FEATURE_DIRS
+  uint32_t open_mapped;  //Set while open -m has the image, whose checksums only catch up on close
+};
+
+extern struct superblock sb;
+
+// Geometry of the open image
+#define BLOCK_SIZE (sb.block_size)
+#define NUM_BLOCKS (sb.num_blocks)
+#define NUM_FILES (sb.num_files)
+#define FIRST_DATA_BLOCK (sb.first_data_block)
+#define MAX_FILE_SIZE ((uint64_t)sb.blocks_per_file * sb.block_size)
+#define NUM_DATA_BLOCKS (NUM_BLOCKS - FIRST_DATA_BLOCK)
+
+// Longest key encrypt accepts
+#define MAX_KEY_SIZE 32
+
+// read output formats
+#define READ_HEX 0
+#define READ_XXD 1
+#define READ_RAW 2
+
+// File attributes
+#define HIDDEN_ATTR 0
+#define READONLY_ATTR 1
+#define COMPRESSED_ATTR 2
+#define DIRECTORY_ATTR 3  //Set by mkdir, the entry names a directory rather than a file
+
+struct directoryEntry {
+  char filename[64];
+  short in_use;
+  int32_t inode;
+};
+
+//in_use of a directory entry holding a snapshot instead of a file
+#define SNAPSHOT_ENTRY 2
+
+//An inode as the commands see it, copied out of the image's inode table by loadInodes and back
+//by storeInode. Its block pointers stay in the table, see fileBlock and setFileBlock
+struct inode {
+  short    in_use;
+  uint8_t  attribute;
+  uint32_t file_size;
+  void    *disk;  //The inode in the table, a struct flatInode or struct mapInode
+};
+
+//Inodes of images without FS_FEATURE_INDIRECT, with a pointer to every block a file can hold
+struct flatInode {
+  int32_t blocks[BLOCKS_PER_FILE];
+  short in_use;
+  uint8_t attribute;
+  uint32_t file_size;
+};
+
+//Inodes of images with FS_FEATURE_INDIRECT, 64 bytes. Pointers hold a data block plus one, zero
+//for none: direct ones to the first blocks of the file, then a block of pointers to blocks, one
+//of pointers to those, and one of pointers to those
+struct mapInode {
+  short    in_use;
+  uint8_t  attribute;
+  uint32_t file_size;
+  uint32_t direct[DIRECT_BLOCKS];
+  uint32_t indirect[INDIRECT_LEVELS];
+};
+
+//A run of physically contiguous data blocks
+struct extent {
+  int32_t  start;
+  uint32_t length;
+};
+
+extern struct directoryEntry *directory;
+extern struct inode          *inodes;
+
+extern char    image_name[64];
+extern uint8_t image_open;
+
+//Batch mode runs a command stream without prompts, collecting errors for the end
+extern uint8_t  batch_mode;
+extern uint32_t batch_line;
+extern uint32_t error_count;
+extern FILE    *error_log;
+
+//Locking, see FS.c for what each lock guards
+extern pthread_rwlock_t meta_lock;
+extern pthread_rwlock_t *inode_locks;
+
+//Allocator and file data helpers shared with the library interface
+extern uint32_t free_block_count;
+
+uint32_t blocksFor(uint32_t size);
+void storeInode(struct inode *thisInode);
+void allocFileBlocks(uint32_t inode, uint32_t first, uint32_t count);
+int growFile(uint32_t inode, uint32_t first, uint32_t count);
+int copyFileData(struct inode *thisInode, uint32_t offset, uint8_t *buf, uint32_t len, uint8_t write);
+uint32_t storedSize(struct inode *thisInode);
+uint32_t storedBlocks(struct inode *thisInode);
+int unshareBlocks(uint32_t inode, uint32_t first, uint32_t count);
+int unpackRange(struct inode *thisInode, uint32_t offset, uint8_t *buf, uint32_t len);
+int32_t verifyBlocks(struct inode *thisInode, uint32_t offset, uint32_t len);
+void markDirty(void *ptr, uint32_t len);
+int32_t findEntry(char *filename, short in_use);
+uint8_t isDirectory(int32_t entry);
+int nextEntry(char *path, uint32_t *cursor, int32_t *entry);
+int checkNewName(char *path);
+char *baseName(char *path);
+int createDirectory(char *path);
+int reserveFile(int32_t *entry, int32_t *inode);
+void cancelFile(int32_t inode);
+void commitEntry(int32_t entry, int32_t inode, uint32_t parent, char *name, uint32_t size);
+void commitFile(int32_t entry, int32_t inode, char *filename, uint32_t size);
+
+//Image handling without output, returning FS_OK or an FS_E* code from libfs.h
+int formatImage(char *filename, uint32_t block_size, uint32_t num_blocks, uint32_t num_files);
+int loadImage(char *filename);
+int mapImage(char *filename);
+int poolImage(char *filename, uint64_t pool_size);
+int saveImage();
+int closeImage();
+
+void fsError(const char *fmt, ...);
+void fsInfo(const char *fmt, ...);
+int32_t fileExists(char* filename);
+
+void readData(char *file, uint32_t startByte, uint32_t numBytes, uint8_t mode);
 void set_attribute(uint32_t file_number, char* attr);
-void list(char *param1, char *param2);
+void list(char *path, uint8_t hidden, uint8_t print_attr);
 void retrieve(char *fileToRerieve, char *newFilename);
-void encryptFile(char *filename, uint8_t cipher);
-void createfs(char *filename);
-void insert(char *filename);
+void encryptFile(char *filename, uint8_t *key, uint32_t key_len);
+void createfs(char *filename, uint32_t block_size, uint32_t num_blocks, uint32_t num_files);
+void insert(char *source, char *filename, uint8_t compress);
+void insertMany(char *source, uint32_t threads);
+void setDedup(char *mode);
+void scrub(uint32_t threads);
+void snapshot(char *name);
+void listSnapshots();
+void deleteSnapshot(char *name);
+void rollback(char *name);
+void cloneFile(char *filename, char *newFilename);
+void makeDirectory(char *path);
+void changeDirectory(char *path);
+void printDirectory();
+void defrag(uint32_t seconds, uint32_t megabytes);
 void openfs(char *filename);
+void openfs_mmap(char *filename);
+void openfs_pool(char *filename, uint32_t pool_mb);
 void undeleteFile(char *filename);
 void deleteFile(char *filename);
 void closefs();
 void savefs();
-uint32_t df();
-void init();
\ No newline at end of file
+uint64_t df();
+void dfUsage(uint64_t *stored, uint64_t *logical);
+void init();
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef LIBFS_H
+#define LIBFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//Embeddable interface to the filesystem image, for use without the FS shell
+//Calls return FS_OK or one of the negative error codes below instead of printing.
+//The filesystem keeps one image in memory, so only one image can be open per process.
+//Calls are thread safe: reads, and writes to different files, run in parallel, while
+//creating files and opening, saving or closing the image wait for everything else.
+
+#if defined(__GNUC__)
+#define FS_API __attribute__((visibility("default")))
+#else
+#define FS_API
+#endif
+
+// Error codes
+#define FS_OK        0
+#define FS_ENOENT   -1   //No such file
+#define FS_EEXIST   -2   //File already exists
+#define FS_ENOSPC   -3   //No free data blocks
+#define FS_ENFILE   -4   //No free directory entry or inode
+#define FS_EFBIG    -5   //Write past MAX_FILE_SIZE
+#define FS_EROFS    -6   //File is read only, or compressed
+#define FS_EBADF    -7   //Handle is closed, stale or not open for writing
+#define FS_EINVAL   -8   //Bad argument
+#define FS_EIO      -9   //Image file could not be read or written, see errno
+#define FS_EBUSY    -10  //An image is already open
+#define FS_ENOIMG   -11  //No image open
+#define FS_ENOMEM   -12  //Out of memory
+#define FS_EBADIMG  -13  //File is not a valid image
+#define FS_ECORRUPT -14  //File data doesn't match its checksum
+
+// fs_open_image flags
+#define FS_IMAGE_MMAP   0x1  //Map the image instead of reading it in, writes go through to the file
+#define FS_IMAGE_CREATE 0x2  //Create a new, empty image with the default geometry
+#define FS_IMAGE_POOL   0x4  //Keep only the tables and a bounded pool of data in memory, writes go to the file
+
+// fs_open flags
+#define FS_O_RDONLY 0x0
+#define FS_O_RDWR   0x1
+#define FS_O_CREAT  0x2  //Create an empty file if it doesn't exist, implies FS_O_RDWR
+
+typedef struct fs_image fs_image;
+typedef struct fs_file  fs_file;
+
+struct fs_stat {
+  char     name[64];
+  uint32_t size;
+  uint8_t  attribute;
+  int32_t  inode;
+};
+
+FS_API int fs_open_image(const char *path, int flags, fs_image **img);
+FS_API int fs_create_image(const char *path, uint32_t block_size, uint32_t num_blocks, uint32_t num_files,
+                           int flags, fs_image **img);
+FS_API int fs_save_image(fs_image *img);
+FS_API int fs_close_image(fs_image *img);
+
+FS_API int fs_open(fs_image *img, const char *name, int flags, fs_file **file);
+FS_API ssize_t fs_pread(fs_file *file, void *buf, size_t len, uint32_t offset);
+FS_API ssize_t fs_pwrite(fs_file *file, const void *buf, size_t len, uint32_t offset);
+FS_API int fs_stat(fs_image *img, const char *name, struct fs_stat *st);
+FS_API int fs_readdir(fs_image *img, const char *path, uint32_t *cursor, struct fs_stat *st);
+FS_API int fs_mkdir(fs_image *img, const char *path);
+FS_API int fs_close(fs_file *file);
+
+FS_API const char *fs_strerror(int code);
+
+#endif
@@ -23,927 +23,6150 @@
 
 #define _GNU_SOURCE
 
+#include <dirent.h>
 #include <errno.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "../include/headers.h"
+#include "../include/libfs.h"
 
-// Input handling
-#define WHITESPACE " \t\n"
-#define MAX_COMMAND_SIZE 255
-#define MAX_NUM_ARGUMENTS 12
+//Blocks claimed at a time when the input size isn't known up front
+#define STREAM_RUN_BLOCKS 64
 
-// FS related
-#define BLOCK_SIZE 1024
-#define NUM_BLOCKS 65536
-#define BLOCKS_PER_FILE 1024
-#define NUM_FILES 256
-#define FIRST_DATA_BLOCK 1364
-#define MAX_FILE_SIZE 1048576
+//Most worker threads insert-many starts
+#define MAX_INSERT_THREADS 64
 
-// File attributes
-#define HIDDEN_ATTR 0
-#define READONLY_ATTR 1
+//Most worker threads scrub starts
+#define MAX_SCRUB_THREADS 64
+
+//Pooled images ask the kernel to read this many bytes ahead of a file being read through
+#define POOL_READAHEAD (1024 * 1024)
+
+// Cipher keys repeat every MAX_KEY_SIZE * 32 bytes at most, a multiple of every vector width
+#define XOR_PERIOD_MAX (MAX_KEY_SIZE * 32)
+
+// read output is buffered and written in chunks this big
+#define OUT_BUF_SIZE 65536
+
+// Journal records, see the Journal section
+#define JOURNAL_MAGIC  0x4c4e524a  //"JRNL"
+#define JOURNAL_COMMIT 0x544d4d43  //"CMMT"
+
+// Committed blocks are written back to the image once the journal grows past this
+#define JOURNAL_CHECKPOINT_SIZE (16 * 1024 * 1024)
+
+// Compressed files are packed in chunks of this many bytes, see the Compression section
+#define PACK_CHUNK 65536
+#define PACK_MAGIC 0x315a4c50  //"PLZ1"
+#define LZ_HASH_BITS 13
+
+// compressFile result for a file that packing wouldn't make any smaller
+#define PACK_NO_GAIN 1
+
+// Snapshot records, see the Snapshots section
+#define SNAP_MAGIC 0x50414e53  //"SNAP"
+
+// Snapshot, rollback and clone result when a block already has the most owners free_blocks counts
+#define BLOCK_REFS_FULL 2
 
 uint8_t *free_blocks;
 uint8_t *free_inodes;
-uint8_t data[NUM_BLOCKS][BLOCK_SIZE];
 
-struct directoryEntry {
-  char filename[64];
-  short in_use;
-  int32_t inode;
+//In-memory bitmap of free data blocks built from free_blocks, 1 = free
+uint64_t *free_map;
+uint32_t free_block_count;
+uint32_t free_hint;
+
+//Open addressed hash index of directory entries by filename, live and deleted
+#define INDEX_EMPTY -1
+#define INDEX_TOMBSTONE -2
+
+struct indexSlot {
+  int32_t  entry;
+  uint32_t hash;
 };
 
-struct inode {
-  int32_t blocks[BLOCKS_PER_FILE];
-  short in_use;
-  uint8_t attribute;
-  uint32_t file_size;
+struct indexSlot *name_index;
+uint32_t          name_index_mask;
+uint32_t          name_index_used;
+
+//Directory tree of images with FS_FEATURE_DIRS. A directory is an entry whose inode has
+//DIRECTORY_ATTR, and the index table after the inodes holds a record of every named entry,
+//sorted by the directory it is in and then by name. Directories are kept as their entry plus one,
+//so the root is 0
+#define ROOT_DIR     0
+#define SNAPSHOT_DIR 0xffffffffu  //Snapshots are filed here, apart from the tree
+#define NO_DIR       0xfffffffeu
+
+struct dirRecord {
+  uint32_t parent;
+  int32_t  entry;
 };
 
+//Each block of the index table. Blocks past index_used hold no records
+struct dirBlock {
+  uint32_t count;
+  uint32_t unused;
+  struct dirRecord records[];
+};
+
+uint32_t  index_used;  //Blocks holding records, at least one
+uint32_t *parents;     //The directory each entry is in, from the index
+uint32_t  cwd;         //Where paths that don't start with / start
+
+//Geometry of the open image, all zero while none is open
+struct superblock sb;
+
+//The whole image, NUM_BLOCKS * BLOCK_SIZE bytes. Anonymous memory, or the image file's
+//mapping when opened with open -m
+uint8_t *data;
+
 struct directoryEntry *directory;
-struct inode          *inodes;
 
-FILE    *fp;
+//The fields of every inode the tables have room for, see loadInodes. The inodes themselves,
+//with their block pointers, are at inode_table in data
+struct inode *inodes;
+uint8_t      *inode_table;
+
 char    image_name[64];
 uint8_t image_open;
-
-//----------FS functions----------
-void printInodeInfo(uint32_t inode_num)
+uint8_t image_mapped;
+int     image_fd = -1;
+
+//One bit per image block modified since the last save
+uint8_t *dirty_blocks;
+uint8_t  dirty_all;
+
+//One bit per image block committed to the journal but not yet written back to the image file
+uint8_t *journal_blocks;
+off_t   journal_size;
+
+//meta_lock guards the directory, the inode tables, the allocator and the image itself.
+//Commands that only read hold it shared, anything that changes the tables holds it exclusive.
+//File data is guarded by the inode's lock, so writers that only touch data blocks (encrypt,
+//fs_pwrite) can hold meta_lock shared. Blocks claimed under a shared meta_lock go through
+//alloc_lock. Locks are taken in that order: meta_lock, inode lock, alloc_lock.
+pthread_rwlock_t meta_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+pthread_rwlock_t *inode_locks;
+pthread_mutex_t  alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Batch mode runs a command stream without prompts, collecting errors for the end
+uint8_t  batch_mode;
+uint32_t batch_line;
+uint32_t error_count;
+FILE    *error_log;
+
+//----------Output----------
+//Report an error, interactively straight away, in batch mode logged with its line number
+void fsError(const char *fmt, ...)
 {
-  struct inode thisInode = inodes[inode_num];
-  if(!thisInode.in_use)
+  va_list args;
+  va_start(args, fmt);
+
+  error_count++;
+  if(batch_mode)
   {
-    printf("Inode %d not in use\n",inode_num);
-    return;
+    fprintf(error_log, "line %u: Error: ", batch_line);
+    vfprintf(error_log, fmt, args);
+  }
+  else
+  {
+    printf("Error: ");
+    vprintf(fmt, args);
   }
 
-  printf("Inode %d blocks: \n",inode_num);
-  uint32_t i;
-  for(i=0; thisInode.blocks[i] != -1; i++)
-    printf("%d ",thisInode.blocks[i]);
-  
-  printf("\n");
-  return;
+  va_end(args);
 }
 
-//Returns file index in directory, or -1 if not found
-int32_t fileExists(char* filename)
+//Print a status message, suppressed in batch mode
+void fsInfo(const char *fmt, ...)
 {
-  int32_t i;
-  for(i = 0; i<NUM_FILES; i++)
-    if(directory[i].in_use && strcmp(directory[i].filename, filename) == 0)
-      return i;
-    
-  return -1;
+  if(batch_mode) return;
+
+  va_list args;
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
 }
 
-int32_t findDeletedFile(char* filename)
+//----------FS functions----------
+//Start of image block b
+static inline uint8_t *blockData(uint32_t b)
 {
-  int32_t i;
-  for(i = 0; i<NUM_FILES; i++)
-    if(!(directory[i].in_use) && strcmp(directory[i].filename, filename) == 0)
-      return i;
-    
-  return -1;
+  return data + (size_t)b * BLOCK_SIZE;
 }
 
-int32_t findFreeBlock()
+//Bytes in a bitmap with one bit per image block
+static inline size_t blockMapSize()
 {
-  int32_t i;
-  for(i = 0; i<NUM_BLOCKS; i++)
-    if(free_blocks[i]) return i;
-  
-  return -1;
+  return (NUM_BLOCKS + 7) / 8;
 }
 
-int32_t findFreeInode()
+//Record that the bytes [ptr, ptr+len) within data have been modified
+void markDirty(void *ptr, uint32_t len)
 {
-  int32_t i;
-  for(i = 0; i < NUM_FILES; i++)
-    if(free_inodes[i]) return i;
-  
-  return -1;
+  if(len == 0) return;
+
+  size_t offset = (uint8_t *)ptr - data;
+  uint32_t i, last = (offset + len - 1) / BLOCK_SIZE;
+
+  //Data writers on different inodes can share a byte of the bitmap
+  for(i = offset / BLOCK_SIZE; i <= last; i++)
+    __atomic_fetch_or(&dirty_blocks[i >> 3], 1 << (i & 7), __ATOMIC_RELAXED);
 }
 
-int32_t findFreeInodeBlock(int32_t inode)
+//Forget changes to one block whose contents no longer matter, such as one just freed
+void markClean(uint32_t block)
 {
-  int32_t i;
-  for(i = 0; i < BLOCKS_PER_FILE; i++)
-    if(inodes[inode].blocks[i] == -1) return i;
-  
-  return -1;
+  __atomic_fetch_and(&dirty_blocks[block >> 3], ~(1 << (block & 7)), __ATOMIC_RELAXED);
+}
+
+//Whether block b has changed since the last save
+static inline uint8_t blockDirty(uint32_t b)
+{
+  return (__atomic_load_n(&dirty_blocks[b >> 3], __ATOMIC_RELAXED) >> (b & 7)) & 1;
 }
 
-int main()
+void clearDirty()
 {
-  char *command_string = (char *)malloc(MAX_COMMAND_SIZE);
+  memset(dirty_blocks, 0, blockMapSize());
+  dirty_all = 0;
+}
 
-  fp = NULL;
+//Returns the next block at or after start whose bit in map equals value, or NUM_BLOCKS if none
+uint32_t nextMapBit(const uint8_t *map, uint32_t start, uint8_t value)
+{
+  uint32_t i;
+  for(i = start; i < NUM_BLOCKS; i++)
+  {
+    //Skip whole bytes that can't contain a match
+    if((i & 7) == 0 && map[i >> 3] == (value ? 0x00 : 0xff))
+    {
+      i += 7;
+      continue;
+    }
+    if(((map[i >> 3] >> (i & 7)) & 1) == value) return i;
+  }
+  return NUM_BLOCKS;
+}
 
-  init();
+//Returns the next dirty block at or after start, or NUM_BLOCKS if none
+uint32_t nextDirty(uint32_t start, uint8_t dirty)
+{
+  return nextMapBit(dirty_blocks, start, dirty);
+}
 
-  while(1)
+//FNV-1a hash of a filename
+uint32_t hashName(char *name)
+{
+  uint32_t hash = 2166136261u;
+  while(*name)
   {
-//----------Input string handling----------
-    //Print out the prompt
-    printf("FS> ");
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
 
-    //Wait for command to read
-    while(!fgets(command_string, MAX_COMMAND_SIZE, stdin));
+void indexAdd(int32_t entry)
+{
+  uint32_t hash = hashName(directory[entry].filename);
+  uint32_t i = hash & name_index_mask;
+
+  while(name_index[i].entry >= 0)
+    i = (i + 1) & name_index_mask;
 
-    //Parse input
-    char *token[MAX_NUM_ARGUMENTS];
+  if(name_index[i].entry == INDEX_EMPTY) name_index_used++;
+  name_index[i].entry = entry;
+  name_index[i].hash = hash;
+}
 
-    uint32_t i, token_count = 0;
-    for(i = 0; i < MAX_NUM_ARGUMENTS; i++)
-      token[i] = NULL;
-    
-    char *argument_ptr = NULL;
-    char *working_string = strdup(command_string);
-    char *head_ptr = working_string;
+void indexRemove(int32_t entry)
+{
+  uint32_t i = hashName(directory[entry].filename) & name_index_mask;
 
-    //Tokenize the input strings with whitespace as delimiter
-    while(((argument_ptr = strsep(&working_string, WHITESPACE)) != NULL) &&
-           (token_count < MAX_NUM_ARGUMENTS))
+  while(name_index[i].entry != INDEX_EMPTY)
+  {
+    if(name_index[i].entry == entry)
     {
-      token[token_count] = strndup(argument_ptr, MAX_COMMAND_SIZE);
-      if(strlen(token[token_count]) == 0) token[token_count] = NULL;
-      token_count++;
+      name_index[i].entry = INDEX_TOMBSTONE;
+      return;
     }
+    i = (i + 1) & name_index_mask;
+  }
+}
 
-//----------Command handling----------
+//----------Directory tree----------
+//Lookups binary search the index table for the block, then within it. Inserts shift the records
+//of one block, splitting it in two when full, and removes merge a block under a quarter full with
+//a neighbour or even them out, so every block but one stays at least a quarter full.
 
-    if(token[0] == NULL)
-      continue;
+static inline uint8_t treeDirs()
+{
+  return (sb.features & FS_FEATURE_DIRS) != 0;
+}
 
-    if(strcmp(token[0], "quit") == 0)
-      exit(0);
+static inline struct dirBlock *indexBlock(uint32_t i)
+{
+  return (struct dirBlock *)blockData(sb.index_block + i);
+}
 
-    if(strcmp("createfs", token[0]) == 0)
-    {
-      if (token[1] == NULL)
-      {
-        printf("Error: No filename specified\n");
-        continue;
-      }
-      createfs(token[1]);
-    }
-    else if(strcmp("savefs", token[0]) == 0)
-    {
-      savefs();
-    }
-    else if( strcmp("open", token[0]) == 0)
-    {
-      if(token[1] == NULL)
-      {
-        printf("Error: No filename specified\n");
-        continue;
-      }
-      openfs(token[1]);
-    }
-    else if(strcmp("close", token[0]) == 0)
-    {
-      closefs();
-    }
-    else if(strcmp("list", token[0]) == 0)
-    {
-      if(!image_open)
-      {
-        printf("Error: No image open\n");
-        continue;
-      }
-      char *param1, *param2;
-      if(token[1] == NULL) param1 = "\0";
-      else param1 = token[1];
+//Records one block of the index table holds
+static inline uint32_t indexPerBlock(uint32_t block_size)
+{
+  return (block_size - sizeof(struct dirBlock)) / sizeof(struct dirRecord);
+}
 
-      if(token[2] == NULL) param2 = "\0";
-      else param2 = token[2];
-      
-      list(param1, param2);
-    }
-    else if(strcmp("df", token[0]) == 0)
-    {
-      if(!image_open)
-      {
-        printf("Error: No image open\n");
-        continue;
-      }
-      printf("%d bytes free\n",df());
-    }
-    else if(strcmp("insert", token[0]) == 0)
-    {
-      if(token[1] == NULL)
-      {
-        printf("Error: No filename specified\n");
-        continue;
-      }
-      insert(token[1]);
-    }
-    else if(strcmp("read", token[0]) == 0)
-    {
-      uint32_t start, num;
+//Blocks of the index table of an image with max_files files and the given block size, enough
+//for every block but one to be a quarter full
+uint32_t indexBlocks(uint32_t block_size, uint32_t max_files)
+{
+  return max_files / (indexPerBlock(block_size) / 4) + 2;
+}
 
-      if(token[1] == NULL)
-      {
-        printf("Error: No filename specified\n");
-        continue;
-      }
-      if(!image_open)
-      {
-        printf("Error: No image open\n");
-        continue;
-      }
+//Order of a record against a directory and name, as strcmp
+static inline int recordCmp(uint32_t parent, char *name, struct dirRecord *rec)
+{
+  if(parent != rec->parent) return parent < rec->parent ? -1 : 1;
+  return strcmp(name, directory[rec->entry].filename);
+}
 
-      //If starting byte not provided, default to zero
-      if(token[2] == NULL) start = 0;
-      else start = atoi(token[2]);
+//Find the first record at or after parent and name, or the end of the table
+void indexSeek(uint32_t parent, char *name, uint32_t *block, uint32_t *pos)
+{
+  uint32_t lo = 0, hi = index_used, mid;
+  struct dirBlock *blk;
 
-      //If num bytes to read not provided, default to file size
-      if(token[3] == NULL)
-      {
-        int32_t ret = fileExists(token[1]);
-        if(ret == -1)
-        {
-          printf("Error: File %s doesn't exist\n",token[1]);
-          continue;
-        }
-        num = inodes[directory[ret].inode].file_size;
-      }
-      else num = atoi(token[3]);
+  //The first block whose last record isn't before it
+  while(lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    blk = indexBlock(mid);
+    if(blk->count > 0 && recordCmp(parent, name, &blk->records[blk->count - 1]) > 0) lo = mid + 1;
+    else hi = mid;
+  }
+  if(lo == index_used)
+  {
+    *block = index_used - 1;
+    *pos = indexBlock(*block)->count;
+    return;
+  }
 
-      if(start < 0 || num < 0)
-      {
-        printf("Error: Invalid read range\n");
-        continue;
-      }
-      readData(token[1],start, num);
-    }
-    else if(strcmp("attrib", token[0]) == 0)
-    {
-      int32_t fileIndex;
-      uint32_t i, j;
-      for(i = 1; i < MAX_NUM_ARGUMENTS; i++)
-      {
-        if(token[i] == NULL)
-        {
-          printf("Error: Incorrect parameters. Ex: attrib [+attribute] <filename>\n");
-          break;
-        }
-        else
-        {
-          if(token[i][0] == '+' || token[i][0] == '-')
-          {
-            continue;
-          }
-          else if((fileIndex = fileExists(token[i])) >=0)
-          {
-            for(j = i; j > 0; --j)
-              set_attribute(fileIndex, token[j]);
-            
-            break;
-          }
-          else
-          {
-            if(fileIndex < 0) printf("Error: File %s doesn't exist\n", token[i]);
-            else printf("Error: Incorrect param format\nEx: attrib [+attribute] [-attribute] <filename>\n");
-            break;
-          }
-        }
-      }
-    }
-    else if(strcmp("retrieve", token[0]) == 0)
-    {
-      if(token[1] == NULL)
-      {
-        printf("Error: No file specified to retrieve\n");
-        continue;
-      }
-      retrieve(token[1], token[2]);
-    }
-    else if(strcmp("encrypt", token[0]) == 0 || strcmp("decrypt", token[0]) == 0)
+  blk = indexBlock(lo);
+  *block = lo;
+  lo = 0;
+  hi = blk->count;
+  while(lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if(recordCmp(parent, name, &blk->records[mid]) > 0) lo = mid + 1;
+    else hi = mid;
+  }
+  *pos = lo;
+}
+
+//The record at block and pos, or NULL past the end of the table, stepping into the next block
+//when pos is past the end of this one
+struct dirRecord *indexAt(uint32_t *block, uint32_t *pos)
+{
+  if(*pos == indexBlock(*block)->count && *block + 1 < index_used)
+  {
+    (*block)++;
+    *pos = 0;
+  }
+  if(*pos == indexBlock(*block)->count) return NULL;
+  return &indexBlock(*block)->records[*pos];
+}
+
+//Returns the entry named name in directory parent with the given in_use state, or -1
+int32_t treeFind(uint32_t parent, char *name, short in_use)
+{
+  uint32_t block, pos;
+  struct dirRecord *rec;
+
+  //Deleted files can share a name with a live one, so look through all of them
+  indexSeek(parent, name, &block, &pos);
+  for(; (rec = indexAt(&block, &pos)) != NULL && recordCmp(parent, name, rec) == 0; pos++)
+    if(directory[rec->entry].in_use == in_use) return rec->entry;
+
+  return -1;
+}
+
+//Whether directory entry entry is a directory
+uint8_t isDirectory(int32_t entry)
+{
+  return directory[entry].in_use == 1 && (inodes[directory[entry].inode].attribute >> DIRECTORY_ATTR) & 1;
+}
+
+//Follow path from the current directory, or from the root if it starts with /, through the
+//directories it names. With leaf, the last component is left there instead of followed
+//Returns the directory reached, or NO_DIR if one on the way doesn't exist
+uint32_t walkPath(char *path, char **leaf)
+{
+  uint32_t dir = path[0] == '/' ? ROOT_DIR : cwd;
+  char name[64];
+  size_t len;
+
+  while(1)
+  {
+    while(*path == '/') path++;
+    len = strcspn(path, "/");
+    if(leaf != NULL && path[len] == '\0')
     {
-      if(token[1] == NULL)
-      {
-        printf("Error: No file specified to encrypt\nEx: encrypt <filename> <cipher>\n");
-        continue;
-      }
-      if(token[2] == NULL)
-      {
-        printf("Error: No cipher specified\nEx: encrypt <filename> <cipher>\n");
-        continue;
-      }
-      encryptFile(token[1], (uint8_t) token[2][0]);
+      *leaf = path;
+      return dir;
     }
-    else if(strcmp("delete", token[0]) == 0)
+    if(len == 0) return dir;
+    if(len >= sizeof(name)) return NO_DIR;
+
+    memcpy(name, path, len);
+    name[len] = '\0';
+    path += len;
+
+    if(strcmp(name, "..") == 0)
     {
-      if(token[1] == NULL)
-      {
-        printf("Error: No file specified to delete\n");
-        continue;
-      }
-      deleteFile(token[1]);
+      if(dir != ROOT_DIR) dir = parents[dir - 1];
     }
-    else if(strcmp("undelete", token[0]) == 0)
+    else if(strcmp(name, ".") != 0)
     {
-      if(token[1] == NULL)
-      {
-        printf("Error: No file specified to undelete\n");
-        continue;
-      }
-      undeleteFile(token[1]);
+      int32_t entry = treeFind(dir, name, 1);
+      if(entry == -1 || !isDirectory(entry)) return NO_DIR;
+      dir = entry + 1;
     }
-    else printf("Error: Unsupported command %s\n",token[0]);
-    
-    
-    //Cleanup allocated memory
-    for(i = 0; i < MAX_NUM_ARGUMENTS; i++)
-      if(token[i] != NULL) free(token[i]);
+  }
+}
+
+//Set *entry to the next live file from *cursor on in directory path, the way list walks it, or
+//to -1 once all have been seen. Images without directories ignore path and walk every file
+//In images with them *cursor counts the directory's records, so whole blocks are stepped over
+int nextEntry(char *path, uint32_t *cursor, int32_t *entry)
+{
+  *entry = -1;
+  if(!treeDirs())
+  {
+    uint32_t i;
+    for(i = *cursor; i < NUM_FILES && directory[i].in_use != 1; i++);
+    *cursor = i < NUM_FILES ? i + 1 : NUM_FILES;
+    if(i < NUM_FILES) *entry = i;
+    return FS_OK;
+  }
 
-    free(head_ptr);
+  uint32_t dir = walkPath(path, NULL), block, pos, skip = *cursor;
+  struct dirRecord *rec;
+  if(dir == NO_DIR) return FS_ENOENT;
+
+  indexSeek(dir, "", &block, &pos);
+  while(pos + skip >= indexBlock(block)->count && block + 1 < index_used)
+  {
+    skip -= indexBlock(block)->count - pos;
+    block++;
+    pos = 0;
   }
+  pos += skip;
 
-  free(command_string);
-  return 0;
+  for(; (rec = indexAt(&block, &pos)) != NULL && rec->parent == dir; pos++)
+  {
+    (*cursor)++;
+    if(directory[rec->entry].in_use != 1) continue;
+    *entry = rec->entry;
+    break;
+  }
+  return FS_OK;
 }
 
-//----------Command functions----------
-
-void deleteFile(char *filename)
+//Move the blocks of the index table from first on by one block, up to make room or down over first
+void shiftBlocks(uint32_t first, int8_t up)
 {
-  int32_t ret = fileExists(filename);
-  if(ret == -1)
+  uint8_t *from = (uint8_t *)indexBlock(first);
+  if(up)
   {
-    printf("Error: File %s doesn't exist\n", filename);
-    return;
+    memmove(from + BLOCK_SIZE, from, (size_t)(index_used - first) * BLOCK_SIZE);
+    index_used++;
   }
-  
-  struct directoryEntry thisDir = directory[ret];
-  
-  //Set directory entry to not in use
-  thisDir.in_use = 0;
-
-  struct inode thisInode = inodes[thisDir.inode];
+  else
+  {
+    memmove(from, from + BLOCK_SIZE, (size_t)(index_used - first - 1) * BLOCK_SIZE);
+    index_used--;
+    indexBlock(index_used)->count = 0;
+  }
+  markDirty(from, (index_used + 1 - first) * BLOCK_SIZE);
+}
 
-  //Set it's inode to not in use
-  thisInode.in_use = 0;
+//File directory entry entry, whose name is set, in directory parent
+void treeInsert(uint32_t parent, int32_t entry)
+{
+  uint32_t block, pos, per = indexPerBlock(BLOCK_SIZE);
+  indexSeek(parent, directory[entry].filename, &block, &pos);
 
-  //Set the inode as free
-  free_inodes[thisDir.inode] = 1;
+  //A full block gives the upper half of its records to a new one after it
+  struct dirBlock *blk = indexBlock(block);
+  if(blk->count == per)
+  {
+    uint32_t keep = per - per / 2;
+    shiftBlocks(block + 1, 1);
+    struct dirBlock *next = indexBlock(block + 1);
+    memcpy(next->records, &blk->records[keep], (per - keep) * sizeof(struct dirRecord));
+    next->count = per - keep;
+    blk->count = keep;
+
+    if(pos > keep)
+    {
+      blk = next;
+      pos -= keep;
+    }
+  }
 
-  //Increment block count to account for partially filled end block
-  uint32_t block_count = thisInode.file_size / BLOCK_SIZE;
-  if(thisInode.file_size % BLOCK_SIZE) block_count++;
+  memmove(&blk->records[pos + 1], &blk->records[pos], (blk->count - pos) * sizeof(struct dirRecord));
+  blk->records[pos].parent = parent;
+  blk->records[pos].entry = entry;
+  blk->count++;
+  markDirty(blk, sizeof(struct dirBlock) + blk->count * sizeof(struct dirRecord));
 
-  //Set the inode blocks as free
-  uint32_t i;
-  for(i = 0; i < block_count; i++)
-    free_blocks[ thisInode.blocks[i] ] = 1;
-  
-  //Save changes
-  inodes[thisDir.inode] = thisInode;
-  directory[ret] = thisDir;
+  parents[entry] = parent;
 }
 
-//If a file's inode, or any of it's blocks are not free undelete fails.
-void undeleteFile(char *filename)
+//Even out blocks block and block + 1 of the index table, or merge them if they fit in one
+void balanceBlocks(uint32_t block)
 {
-  int32_t ret = findDeletedFile(filename);
-  if(ret == -1)
+  struct dirBlock *left = indexBlock(block), *right = indexBlock(block + 1);
+  uint32_t total = left->count + right->count, n;
+
+  if(total <= indexPerBlock(BLOCK_SIZE))
   {
-    printf("Error: No such deleted file %s to recover\n", filename);
+    memcpy(&left->records[left->count], right->records, right->count * sizeof(struct dirRecord));
+    left->count = total;
+    markDirty(left, BLOCK_SIZE);
+    shiftBlocks(block + 1, 0);
     return;
   }
 
-  struct directoryEntry thisDir = directory[ret];
-  struct inode thisInode = inodes[thisDir.inode];
-
-  if(thisInode.in_use || !(free_inodes[thisDir.inode]))
+  if(left->count < total / 2)
   {
-    printf("Error: File %s inode overwritten, cannot undelete\n", filename);
-    return;
+    n = total / 2 - left->count;
+    memcpy(&left->records[left->count], right->records, n * sizeof(struct dirRecord));
+    memmove(right->records, &right->records[n], (right->count - n) * sizeof(struct dirRecord));
+    left->count += n;
+    right->count -= n;
   }
+  else
+  {
+    n = left->count - total / 2;
+    memmove(&right->records[n], right->records, right->count * sizeof(struct dirRecord));
+    memcpy(right->records, &left->records[left->count - n], n * sizeof(struct dirRecord));
+    left->count -= n;
+    right->count += n;
+  }
+  markDirty(left, 2 * BLOCK_SIZE);
+}
 
-  uint32_t block_count = thisInode.file_size / BLOCK_SIZE;
-  if(thisInode.file_size % BLOCK_SIZE) block_count++;
+//Take directory entry entry out of the index, before its name is cleared
+void treeRemove(int32_t entry)
+{
+  uint32_t block, pos, parent = parents[entry];
+  struct dirRecord *rec;
 
-  uint32_t i;
-  for(i = 0; i < block_count; i++)
+  indexSeek(parent, directory[entry].filename, &block, &pos);
+  while((rec = indexAt(&block, &pos)) != NULL && recordCmp(parent, directory[entry].filename, rec) == 0)
   {
-    if(!(free_blocks[ thisInode.blocks[i] ]))
+    if(rec->entry != entry)
     {
-      printf("Error: File %s block overwritten, cannot undelete\n", filename);
-      return;
+      pos++;
+      continue;
     }
-  }
 
-  for(i = 0; i < block_count; i++)
-    free_blocks[ thisInode.blocks[i] ] = 0;
-  
-  thisInode.in_use = 1;
-  thisDir.in_use = 1;
+    struct dirBlock *blk = indexBlock(block);
+    memmove(rec, rec + 1, (blk->count - pos - 1) * sizeof(struct dirRecord));
+    blk->count--;
+    markDirty(blk, sizeof(struct dirBlock) + (blk->count + 1) * sizeof(struct dirRecord));
 
-  inodes[thisDir.inode] = thisInode;
-  directory[ret] = thisDir;
-}
+    if(index_used > 1 && blk->count < indexPerBlock(BLOCK_SIZE) / 4)
+      balanceBlocks(block + 1 < index_used ? block : block - 1);
+    return;
+  }
+}
+
+//Check the index table of a newly opened image: every block within its size, and every record
+//naming an entry in the directory. Returns FS_OK, or FS_ECORRUPT
+int checkDirIndex()
+{
+  uint32_t i, j, blocks = indexBlocks(BLOCK_SIZE, sb.max_files);
+  if(!treeDirs()) return FS_OK;
+
+  for(i = 0; i < blocks; i++)
+  {
+    struct dirBlock *blk = indexBlock(i);
+    if(blk->count > indexPerBlock(BLOCK_SIZE)) return FS_ECORRUPT;
+
+    for(j = 0; j < blk->count; j++)
+    {
+      struct dirRecord *rec = &blk->records[j];
+      if(rec->entry < 0 || (uint32_t)rec->entry >= NUM_FILES || directory[rec->entry].filename[0] == '\0')
+        return FS_ECORRUPT;
+      if(rec->parent != SNAPSHOT_DIR && rec->parent > NUM_FILES) return FS_ECORRUPT;
+    }
+  }
+  return FS_OK;
+}
+
+//Find where the records of the index table end and the directory of every entry in them
+void loadParents()
+{
+  uint32_t i, j, blocks = indexBlocks(BLOCK_SIZE, sb.max_files);
+  for(index_used = 1; index_used < blocks && indexBlock(index_used)->count > 0; index_used++);
+
+  for(i = 0; i < index_used; i++)
+  {
+    struct dirBlock *blk = indexBlock(i);
+    for(j = 0; j < blk->count; j++)
+      parents[blk->records[j].entry] = blk->records[j].parent;
+  }
+}
+
+//Rebuild the filename index, sized to keep the table at most half full
+//Images with directories use their index table instead, only the parents are rebuilt
+void buildIndex()
+{
+  uint32_t i, size = 16;
+
+  if(treeDirs())
+  {
+    loadParents();
+    return;
+  }
+  while(size < 2 * NUM_FILES) size <<= 1;
+
+  free(name_index);
+  name_index = malloc(size * sizeof(struct indexSlot));
+  name_index_mask = size - 1;
+
+  for(i = 0; i < size; i++)
+    name_index[i].entry = INDEX_EMPTY;
+  name_index_used = 0;
+
+  for(i = 0; i < NUM_FILES; i++)
+    if(directory[i].filename[0] != '\0') indexAdd(i);
+}
+
+//Returns the index of a directory entry with the given name and in_use state, or -1
+//In images with directories the name is a path, except for snapshots, which are filed apart
+int32_t findEntry(char *filename, short in_use)
+{
+  if(treeDirs())
+  {
+    if(in_use == SNAPSHOT_ENTRY) return treeFind(SNAPSHOT_DIR, filename, in_use);
+
+    char *leaf;
+    uint32_t dir = walkPath(filename, &leaf);
+    return dir == NO_DIR ? -1 : treeFind(dir, leaf, in_use);
+  }
+
+  uint32_t hash = hashName(filename);
+  uint32_t i = hash & name_index_mask;
+  int32_t entry;
+
+  while((entry = name_index[i].entry) != INDEX_EMPTY)
+  {
+    if(entry >= 0 && name_index[i].hash == hash && directory[entry].in_use == in_use &&
+       strcmp(directory[entry].filename, filename) == 0)
+      return entry;
+
+    i = (i + 1) & name_index_mask;
+  }
+
+  return -1;
+}
+
+//Returns file index in directory, or -1 if not found
+int32_t fileExists(char* filename)
+{
+  return findEntry(filename, 1);
+}
+
+int32_t findDeletedFile(char* filename)
+{
+  return findEntry(filename, 0);
+}
+
+//File directory entry entry, whose name is set, for lookups, in directory parent
+void nameAdd(int32_t entry, uint32_t parent)
+{
+  if(treeDirs()) treeInsert(parent, entry);
+  //Rebuild once tombstones fill a quarter of the table so probes stay short
+  else if(name_index_used > (name_index_mask + 1) * 3 / 4) buildIndex();
+  else indexAdd(entry);
+}
+
+//Take directory entry entry out of lookups, before its name is cleared
+void nameRemove(int32_t entry)
+{
+  if(treeDirs()) treeRemove(entry);
+  else indexRemove(entry);
+}
+
+//Check that path can name a new file or directory: the directory it is in exists, and nothing
+//there has the name. Returns FS_OK, FS_EEXIST, FS_ENOENT, or FS_EINVAL for a name that can't be used
+int checkNewName(char *path)
+{
+  if(!treeDirs())
+  {
+    if(path[0] == '\0' || strlen(path) > 63) return FS_EINVAL;
+    return fileExists(path) == -1 ? FS_OK : FS_EEXIST;
+  }
+
+  char *leaf;
+  uint32_t dir = walkPath(path, &leaf);
+  if(dir == NO_DIR) return FS_ENOENT;
+  if(leaf[0] == '\0' || strlen(leaf) > 63 || strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) return FS_EINVAL;
+  return treeFind(dir, leaf, 1) == -1 ? FS_OK : FS_EEXIST;
+}
+
+//The last component of path, what a file inserted or retrieved under it is called
+char *baseName(char *path)
+{
+  char *slash = strrchr(path, '/');
+  return slash == NULL ? path : slash + 1;
+}
+
+//Make a directory at path. Caller holds meta_lock exclusive
+//Returns FS_OK, FS_EEXIST, FS_ENOENT, FS_EINVAL for a name that can't be used, or FS_ENFILE
+int createDirectory(char *path)
+{
+  if(!treeDirs()) return FS_EINVAL;
+
+  int ret = checkNewName(path);
+  if(ret != FS_OK) return ret;
+
+  char *leaf;
+  uint32_t parent = walkPath(path, &leaf);
+  int32_t entry, inode;
+  ret = reserveFile(&entry, &inode);
+  if(ret != FS_OK) return ret;
+
+  //A directory holds no blocks, its files find it through the index
+  commitEntry(entry, inode, parent, leaf, 0);
+  inodes[inode].attribute = 1 << DIRECTORY_ATTR;
+  storeInode(&inodes[inode]);
+  return FS_OK;
+}
+
+//Rebuild the free block bitmap and counter from the image's free_blocks table
+void loadFreeMap()
+{
+  uint32_t i;
+  memset(free_map, 0, (NUM_DATA_BLOCKS + 63) / 64 * sizeof(uint64_t));
+  free_block_count = 0;
+  free_hint = 0;
+
+  //Entries past NUM_DATA_BLOCKS would index beyond data, never hand them out
+  for(i = 0; i < NUM_DATA_BLOCKS; i++)
+  {
+    if(free_blocks[i] == 1)
+    {
+      free_map[i >> 6] |= 1ULL << (i & 63);
+      free_block_count++;
+    }
+  }
+}
+
+//Returns the first free block at or after the hint, wrapping around, or -1 if full
+int32_t findFreeBlock()
+{
+  if(free_block_count == 0) return -1;
+
+  uint32_t words = (NUM_DATA_BLOCKS + 63) / 64;
+  uint32_t w = free_hint >> 6, n;
+
+  //Ignore bits below the hint in its own word on the first pass
+  uint64_t word = free_map[w] & (~0ULL << (free_hint & 63));
+
+  for(n = 0; n <= words; n++)
+  {
+    if(word) return (w << 6) + __builtin_ctzll(word);
+
+    w = (w + 1) % words;
+    word = free_map[w];
+  }
+
+  return -1;
+}
+
+//Number of files sharing a data block. free_blocks holds 1 for a free block and 0 for a block
+//with one owner, as it always has, and the count itself once blocks are shared by dedup
+static inline uint32_t blockRefs(uint32_t block)
+{
+  uint8_t v = free_blocks[block];
+  return v == 1 ? 0 : v == 0 ? 1 : v;
+}
+
+static inline void setBlockRefs(uint32_t block, uint32_t refs)
+{
+  free_blocks[block] = refs == 0 ? 1 : refs == 1 ? 0 : refs;
+  markDirty(&free_blocks[block], 1);
+}
+
+//Mark a data block as used
+void claimBlock(uint32_t block)
+{
+  free_map[block >> 6] &= ~(1ULL << (block & 63));
+  free_block_count--;
+  free_hint = block + 1 < NUM_DATA_BLOCKS ? block + 1 : 0;
+
+  free_blocks[block] = 0;
+  markDirty(&free_blocks[block], 1);
+}
+
+//Drop a reference to a data block, freeing it once no file shares it
+void releaseBlock(uint32_t block)
+{
+  uint32_t refs = blockRefs(block);
+  if(refs > 1)
+  {
+    setBlockRefs(block, refs - 1);
+    return;
+  }
+
+  free_map[block >> 6] |= 1ULL << (block & 63);
+  free_block_count++;
+
+  free_blocks[block] = 1;
+  markDirty(&free_blocks[block], 1);
+}
+
+//Whether the open image's inodes reach their blocks through blocks of pointers
+static inline uint8_t indirectInodes()
+{
+  return (sb.features & FS_FEATURE_INDIRECT) != 0;
+}
+
+//Copy count inodes from the image's inode table, starting at first, into inodes
+void loadInodes(uint32_t first, uint32_t count)
+{
+  uint32_t i;
+  for(i = first; i < first + count; i++)
+  {
+    if(indirectInodes())
+    {
+      struct mapInode *node = (struct mapInode *)inode_table + i;
+      inodes[i].in_use = node->in_use;
+      inodes[i].attribute = node->attribute;
+      inodes[i].file_size = node->file_size;
+      inodes[i].disk = node;
+    }
+    else
+    {
+      struct flatInode *node = (struct flatInode *)inode_table + i;
+      inodes[i].in_use = node->in_use;
+      inodes[i].attribute = node->attribute;
+      inodes[i].file_size = node->file_size;
+      inodes[i].disk = node;
+    }
+  }
+}
+
+//Write an inode's fields back to the image's inode table
+void storeInode(struct inode *thisInode)
+{
+  if(indirectInodes())
+  {
+    struct mapInode *node = thisInode->disk;
+    node->in_use = thisInode->in_use;
+    node->attribute = thisInode->attribute;
+    node->file_size = thisInode->file_size;
+    markDirty(node, offsetof(struct mapInode, direct));
+    return;
+  }
+
+  struct flatInode *node = thisInode->disk;
+  node->in_use = thisInode->in_use;
+  node->attribute = thisInode->attribute;
+  node->file_size = thisInode->file_size;
+  markDirty(&node->in_use, sizeof(*node) - offsetof(struct flatInode, in_use));
+}
+
+//Rebuild the in-memory lookup structures after the tables have been loaded or reset
+void loadTables()
+{
+  loadInodes(0, sb.max_files);
+  loadFreeMap();
+  buildIndex();
+}
+
+//Find and claim a free data block, or -1 if full
+int32_t allocBlock()
+{
+  int32_t block = findFreeBlock();
+  if(block != -1) claimBlock(block);
+  return block;
+}
+
+uint8_t isBlockFree(uint32_t block)
+{
+  if(block >= NUM_DATA_BLOCKS) return 0;
+  return (free_map[block >> 6] >> (block & 63)) & 1;
+}
+
+//Returns the next block at or after pos whose free bit equals value, or NUM_DATA_BLOCKS
+uint32_t nextFreeMapBit(uint32_t pos, uint8_t value)
+{
+  uint32_t words = (NUM_DATA_BLOCKS + 63) / 64;
+  uint32_t w = pos >> 6;
+  if(w >= words) return NUM_DATA_BLOCKS;
+
+  uint64_t word = (value ? free_map[w] : ~free_map[w]) & (~0ULL << (pos & 63));
+  while(!word)
+  {
+    if(++w >= words) return NUM_DATA_BLOCKS;
+    word = value ? free_map[w] : ~free_map[w];
+  }
+
+  pos = (w << 6) + __builtin_ctzll(word);
+  return pos < NUM_DATA_BLOCKS ? pos : NUM_DATA_BLOCKS;
+}
+
+//Find the first free run of at least want blocks, or failing that the longest one
+//Returns the run length (at most want) and stores its first block in start
+uint32_t findFreeRun(uint32_t want, uint32_t *start)
+{
+  uint32_t pos = nextFreeMapBit(0, 1), end, best = 0;
+  while(pos < NUM_DATA_BLOCKS)
+  {
+    end = nextFreeMapBit(pos, 0);
+    if(end - pos >= want)
+    {
+      *start = pos;
+      return want;
+    }
+    if(end - pos > best)
+    {
+      best = end - pos;
+      *start = pos;
+    }
+    pos = nextFreeMapBit(end, 1);
+  }
+  return best;
+}
+
+//Number of blocks needed to hold size bytes
+uint32_t blocksFor(uint32_t size)
+{
+  return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+//Block pointers held by one block of pointers
+static inline uint32_t mapPointers()
+{
+  return BLOCK_SIZE / sizeof(uint32_t);
+}
+
+//Most blocks a file can hold in an image with FS_FEATURE_INDIRECT and the given block size
+//Sizes are kept in 32 bits, so files stop short of 2 GB even where the pointers reach further
+uint32_t mapCapacity(uint32_t block_size)
+{
+  uint64_t per = block_size / sizeof(uint32_t), span = per, blocks = DIRECT_BLOCKS;
+  uint64_t limit = 0x80000000ULL / block_size;
+  uint32_t level;
+
+  for(level = 0; level < INDIRECT_LEVELS; level++, span *= per)
+    blocks += span;
+  return blocks < limit ? blocks : limit;
+}
+
+//Number of blocks of pointers a file of count blocks needs, none in images without them
+uint32_t mapBlocksFor(uint32_t count)
+{
+  if(!indirectInodes() || count <= DIRECT_BLOCKS) return 0;
+
+  uint64_t per = mapPointers(), span = per, left = count - DIRECT_BLOCKS, blocks = 0, n, under;
+  uint32_t level, l;
+
+  //A tree of level levels has a block at each level for every span of blocks beneath it
+  for(level = 1; level <= INDIRECT_LEVELS && left > 0; level++, span *= per, left -= n)
+  {
+    n = left < span ? left : span;
+    for(l = 0, under = per; l < level; l++, under *= per)
+      blocks += (n + under - 1) / under;
+  }
+  return blocks;
+}
+
+//Data block holding file block idx of the inode
+int32_t fileBlock(struct inode *thisInode, uint32_t idx)
+{
+  if(!indirectInodes()) return ((struct flatInode *)thisInode->disk)->blocks[idx];
+
+  struct mapInode *node = thisInode->disk;
+  if(idx < DIRECT_BLOCKS) return (int32_t)node->direct[idx] - 1;
+
+  //Find the tree the block is in, then follow its pointers down
+  uint64_t per = mapPointers(), span = per, pos = idx - DIRECT_BLOCKS;
+  uint32_t level = 0, ptr;
+  while(pos >= span)
+  {
+    pos -= span;
+    span *= per;
+    level++;
+  }
+
+  ptr = node->indirect[level];
+  do
+  {
+    span /= per;
+    ptr = ((uint32_t *)blockData(FIRST_DATA_BLOCK + ptr - 1))[pos / span];
+    pos %= span;
+  } while(span > 1);
+
+  return (int32_t)ptr - 1;
+}
+
+//Fill in the extent of contiguous data blocks starting at file block idx, covering at most max blocks
+uint32_t nextExtent(struct inode *thisInode, uint32_t idx, uint32_t max, struct extent *ext)
+{
+  ext->start = fileBlock(thisInode, idx);
+  ext->length = 1;
+  while(ext->length < max && fileBlock(thisInode, idx + ext->length) == ext->start + ext->length)
+    ext->length++;
+
+  return ext->length;
+}
+
+//Number of the first count blocks of a file that no other file or snapshot shares, the ones
+//the file letting go of them would free
+uint32_t unsharedBlocks(struct inode *thisInode, uint32_t count)
+{
+  uint32_t i, n = 0;
+  for(i = 0; i < count; i++)
+    if(blockRefs(fileBlock(thisInode, i)) < 2) n++;
+  return n;
+}
+
+void printInodeInfo(uint32_t inode_num)
+{
+  struct inode thisInode = inodes[inode_num];
+  if(!thisInode.in_use)
+  {
+    printf("Inode %d not in use\n",inode_num);
+    return;
+  }
+
+  printf("Inode %d blocks: \n",inode_num);
+  uint32_t i;
+  for(i=0; i < storedBlocks(&thisInode); i++)
+    printf("%d ",fileBlock(&thisInode, i));
+  
+  printf("\n");
+  return;
+}
+
+//Running checksum for journal records and block fingerprints, 64 bit FNV-1a over words
+uint64_t checksum(const void *buf, size_t len, uint64_t sum)
+{
+  const uint8_t *p = buf;
+  uint64_t word;
+  while(len >= 8)
+  {
+    memcpy(&word, p, 8);
+    sum = (sum ^ word) * 1099511628211ULL;
+    p += 8;
+    len -= 8;
+  }
+  while(len--)
+    sum = (sum ^ *p++) * 1099511628211ULL;
+  return sum;
+}
+
+//Read until len bytes are in buf or the input ends, returns the bytes read or -1
+ssize_t readFully(int fd, uint8_t *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t n;
+  while(done < len)
+  {
+    n = read(fd, buf + done, len - done);
+    if(n == -1 && errno == EINTR) continue;
+    if(n == -1) return -1;
+    if(n == 0) break;
+    done += n;
+  }
+  return done;
+}
+
+//Write all of buf, returns 0 or -1
+int writeFully(int fd, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  ssize_t n;
+  while(len > 0)
+  {
+    n = write(fd, p, len);
+    if(n == -1 && errno == EINTR) continue;
+    if(n == -1) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+//----------CRC32C----------
+//One CRC32C per block of images with FS_FEATURE_CRC, see the Checksums section
+uint32_t *block_crcs;
+
+//Blocks are checksummed as three interleaved lanes of CRC_LANE bytes, see crcSSE42
+#define CRC_LANE 256
+
+//Slicing-by-8 tables for the reflected Castagnoli polynomial, and tables that advance a CRC
+//over CRC_LANE zero bytes one byte of it at a time
+uint32_t crc_table[8][256];
+uint32_t crc_shift[4][256];
+
+//Continue crc over buf, eight bytes per step. crc is the raw register, without the inversions
+uint32_t crcSlice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  uint32_t lo, hi;
+  while(len >= 8)
+  {
+    memcpy(&lo, buf, 4);
+    memcpy(&hi, buf + 4, 4);
+    lo ^= crc;
+    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+          crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+          crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+          crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+
+    buf += 8;
+    len -= 8;
+  }
+  while(len--)
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xff];
+  return crc;
+}
+
+//The register after CRC_LANE zero bytes is linear in the register before them
+static inline uint32_t crcShift(uint32_t crc)
+{
+  return crc_shift[0][crc & 0xff] ^ crc_shift[1][(crc >> 8) & 0xff] ^
+         crc_shift[2][(crc >> 16) & 0xff] ^ crc_shift[3][crc >> 24];
+}
+
+void initCrcTables()
+{
+  uint32_t i, j, crc;
+  for(i = 0; i < 256; i++)
+  {
+    crc = i;
+    for(j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+    crc_table[0][i] = crc;
+  }
+  for(i = 0; i < 256; i++)
+    for(j = 1; j < 8; j++)
+      crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+
+  //Shift each register bit over a lane of zeros, then build every byte value out of its bits
+  static const uint8_t zeros[CRC_LANE];
+  uint32_t bits[32];
+  for(i = 0; i < 32; i++)
+    bits[i] = crcSlice8(1U << i, zeros, CRC_LANE);
+
+  for(i = 0; i < 4; i++)
+    for(j = 0; j < 256; j++)
+    {
+      uint32_t k;
+      crc = 0;
+      for(k = 0; k < 8; k++)
+        if(j & (1 << k)) crc ^= bits[i * 8 + k];
+      crc_shift[i][j] = crc;
+    }
+}
+
+#if defined(__x86_64__)
+//The crc32 instruction takes three cycles but issues every cycle, so three independent lanes
+//keep it busy. The lanes are joined by shifting the earlier ones over the later ones' length.
+__attribute__((target("sse4.2")))
+uint32_t crcSSE42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+  uint64_t c0 = crc, c1, c2, v0, v1, v2;
+  uint32_t i;
+
+  while(len >= 3 * CRC_LANE)
+  {
+    c1 = 0;
+    c2 = 0;
+    for(i = 0; i < CRC_LANE; i += 8)
+    {
+      memcpy(&v0, buf + i, 8);
+      memcpy(&v1, buf + CRC_LANE + i, 8);
+      memcpy(&v2, buf + 2 * CRC_LANE + i, 8);
+      c0 = _mm_crc32_u64(c0, v0);
+      c1 = _mm_crc32_u64(c1, v1);
+      c2 = _mm_crc32_u64(c2, v2);
+    }
+    c0 = crcShift(crcShift(c0) ^ c1) ^ c2;
+
+    buf += 3 * CRC_LANE;
+    len -= 3 * CRC_LANE;
+  }
+
+  while(len >= 8)
+  {
+    memcpy(&v0, buf, 8);
+    c0 = _mm_crc32_u64(c0, v0);
+    buf += 8;
+    len -= 8;
+  }
+
+  crc = c0;
+  while(len--)
+    crc = _mm_crc32_u8(crc, *buf++);
+  return crc;
+}
+#endif
+
+uint32_t (*crcKernel)(uint32_t, const uint8_t *, size_t) = crcSlice8;
+
+//Use the crc32 instruction where the CPU has it
+void selectCrcKernel()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2")) crcKernel = crcSSE42;
+#endif
+}
+
+uint32_t crc32c(const void *buf, size_t len)
+{
+  return ~crcKernel(~0U, buf, len);
+}
+
+//Checksum of image block b, as the table holds it
+static inline uint32_t blockCrc(uint32_t b)
+{
+  return crc32c(blockData(b), BLOCK_SIZE);
+}
+
+//----------Buffer pool----------
+//Images opened with open -p keep only their tables resident. data still spans the whole image,
+//but its data blocks are read in from the image file on first use, and dropped again once more
+//than pool_limit units of them are resident, so memory follows the pool size rather than the
+//image size. A unit is the whole pages and whole blocks the memory is handed back in.
+//Every access to data blocks pins them between pinBlocks and unpinBlocks. Eviction is CLOCK:
+//pinning sets a unit's referenced bit, and the hand clears the bits it passes and evicts the first
+//unpinned unit it finds already clear. Dirty blocks of an evicted unit are written back to the
+//image file with their checksums, so pooled images are written in place, like mapped ones.
+#define POOL_RESIDENT   0x1
+#define POOL_REFERENCED 0x2
+
+uint8_t   image_pooled;
+uint32_t  pool_unit_blocks;  //Blocks per unit
+uint32_t  pool_first_unit;   //Units before it hold tables and are always resident
+uint32_t  pool_limit;        //Most units kept resident, only exceeded while they are all pinned
+uint32_t *pool_ring;         //Resident units, in the order the hand visits them
+uint32_t  pool_ring_size;
+uint32_t  pool_resident;
+uint32_t  pool_hand;
+uint8_t  *unit_flags;
+uint16_t *unit_pins;
+
+//Guards all of the pool state above but image_pooled, taken after alloc_lock
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Number of units the image is split into
+static inline uint32_t poolUnits()
+{
+  return (NUM_BLOCKS + pool_unit_blocks - 1) / pool_unit_blocks;
+}
+
+//Write back the dirty blocks of a unit and hand its memory back
+//Returns 0, or -1 if a block couldn't be written, leaving the unit resident
+int poolEvict(uint32_t unit)
+{
+  uint32_t b, first = unit * pool_unit_blocks, end = first + pool_unit_blocks;
+  if(end > NUM_BLOCKS) end = NUM_BLOCKS;
+
+  for(b = first; b < end; b++)
+  {
+    if(!blockDirty(b)) continue;
+
+    //The block won't be in memory when the next save brings the checksums up to date
+    if(block_crcs != NULL)
+    {
+      block_crcs[b] = blockCrc(b);
+      markDirty(&block_crcs[b], sizeof(uint32_t));
+    }
+    if(pwrite(image_fd, blockData(b), BLOCK_SIZE, (off_t)b * BLOCK_SIZE) != (ssize_t)BLOCK_SIZE) return -1;
+    markClean(b);
+  }
+
+  madvise(blockData(first), (size_t)pool_unit_blocks * BLOCK_SIZE, MADV_DONTNEED);
+  unit_flags[unit] = 0;
+  return 0;
+}
+
+//Evict unpinned units until want more fit within pool_limit, or none is left to evict
+void poolMakeRoom(uint32_t want)
+{
+  uint32_t unit, steps = 0;
+
+  //Two turns of the hand clear every referenced bit on the way
+  while(pool_resident + want > pool_limit && steps++ < 2 * pool_resident)
+  {
+    if(pool_hand >= pool_resident) pool_hand = 0;
+    unit = pool_ring[pool_hand];
+
+    if(unit_pins[unit] == 0 && !(unit_flags[unit] & POOL_REFERENCED) && poolEvict(unit) == 0)
+    {
+      pool_ring[pool_hand] = pool_ring[--pool_resident];
+      continue;
+    }
+
+    unit_flags[unit] &= ~POOL_REFERENCED;
+    pool_hand++;
+  }
+}
+
+//Record a unit as resident. Returns 0, or -1 if the ring can't grow to hold it
+int poolAdd(uint32_t unit)
+{
+  if(pool_resident == pool_ring_size)
+  {
+    uint32_t size = pool_ring_size ? pool_ring_size * 2 : pool_limit;
+    uint32_t *ring = realloc(pool_ring, (size_t)size * sizeof(uint32_t));
+    if(ring == NULL) return -1;
+    pool_ring = ring;
+    pool_ring_size = size;
+  }
+
+  pool_ring[pool_resident++] = unit;
+  unit_flags[unit] = POOL_RESIDENT | POOL_REFERENCED;
+  return 0;
+}
+
+//Read units [first, end) in from the image file. Returns 0 or -1
+int poolRead(uint32_t first, uint32_t end)
+{
+  uint8_t *buf = blockData(first * pool_unit_blocks);
+  off_t pos = (off_t)first * pool_unit_blocks * BLOCK_SIZE;
+  off_t last = (off_t)end * pool_unit_blocks * BLOCK_SIZE;
+  if(last > (off_t)NUM_BLOCKS * BLOCK_SIZE) last = (off_t)NUM_BLOCKS * BLOCK_SIZE;
+
+  size_t done = 0, len = last - pos;
+  ssize_t n;
+  while(done < len)
+  {
+    n = pread(image_fd, buf + done, len - done, pos + done);
+    if(n == -1 && errno == EINTR) continue;
+    if(n == -1) return -1;
+    if(n == 0) break;
+    done += n;
+  }
+  return 0;
+}
+
+//Whether a unit has to be read in to pin blocks [first, first+count). Blocks that were just
+//claimed hold nothing worth reading, so neither does a unit made up of only them
+static inline uint8_t poolNeedsRead(uint32_t unit, uint32_t first, uint32_t count, uint8_t fresh)
+{
+  return !fresh || unit * pool_unit_blocks < first || (unit + 1) * pool_unit_blocks > first + count;
+}
+
+//Make blocks [first, first+count) resident and keep them so until unpinBlocks. fresh says the
+//blocks were just claimed. Returns their address in data, or NULL if they couldn't be read
+uint8_t *pinBlocks(uint32_t first, uint32_t count, uint8_t fresh)
+{
+  if(!image_pooled || count == 0) return blockData(first);
+
+  uint32_t u, end, missing = 0;
+  uint32_t first_unit = first / pool_unit_blocks, last_unit = (first + count - 1) / pool_unit_blocks;
+  if(first_unit < pool_first_unit) first_unit = pool_first_unit;
+
+  pthread_mutex_lock(&pool_lock);
+
+  //Pin before making room, so this run can't be evicted to make room for itself
+  for(u = first_unit; u <= last_unit; u++)
+  {
+    unit_pins[u]++;
+    if(unit_flags[u] & POOL_RESIDENT) unit_flags[u] |= POOL_REFERENCED;
+    else missing++;
+  }
+  if(missing) poolMakeRoom(missing);
+
+  //Read each run of missing units with a single pread
+  for(u = first_unit; u <= last_unit; u = end)
+  {
+    end = u + 1;
+    if(unit_flags[u] & POOL_RESIDENT) continue;
+
+    if(poolNeedsRead(u, first, count, fresh))
+    {
+      while(end <= last_unit && !(unit_flags[end] & POOL_RESIDENT) && poolNeedsRead(end, first, count, fresh))
+        end++;
+      if(poolRead(u, end) == -1) goto fail;
+    }
+
+    for(; u < end; u++)
+      if(poolAdd(u) == -1) goto fail;
+  }
+
+  pthread_mutex_unlock(&pool_lock);
+  return blockData(first);
+
+fail:
+  for(u = first_unit; u <= last_unit; u++)
+    unit_pins[u]--;
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+//Let blocks pinned by pinBlocks be evicted again
+void unpinBlocks(uint32_t first, uint32_t count)
+{
+  if(!image_pooled || count == 0) return;
+
+  uint32_t u, first_unit = first / pool_unit_blocks, last_unit = (first + count - 1) / pool_unit_blocks;
+  if(first_unit < pool_first_unit) first_unit = pool_first_unit;
+
+  pthread_mutex_lock(&pool_lock);
+  for(u = first_unit; u <= last_unit; u++)
+    unit_pins[u]--;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+//Keep the kernel reading POOL_READAHEAD bytes ahead of a walk over a file's blocks that has
+//reached file block idx and stops at file block end, so the pool's reads find them cached.
+//ahead holds how far the walk has asked for, start it at idx
+void prefetchAhead(struct inode *thisInode, uint32_t idx, uint32_t end, uint32_t *ahead)
+{
+  if(!image_pooled) return;
+
+  uint32_t window = POOL_READAHEAD / BLOCK_SIZE, target = end - idx > window ? idx + window : end;
+  struct extent ext;
+
+  //Top the window up once half of it has been used
+  if(*ahead < idx) *ahead = idx;
+  if(*ahead >= target || *ahead - idx > window / 2) return;
+
+  for(; *ahead < target; *ahead += ext.length)
+  {
+    nextExtent(thisInode, *ahead, target - *ahead, &ext);
+    posix_fadvise(image_fd, (off_t)(FIRST_DATA_BLOCK + ext.start) * BLOCK_SIZE,
+                  (off_t)ext.length * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+  }
+}
+
+//Copy len bytes between a file, starting at offset, and buf. The range must lie within the
+//file's blocks. Writes mark the blocks dirty. Returns 0, or -1 if blocks of a pooled image
+//couldn't be read in
+int copyFileData(struct inode *thisInode, uint32_t offset, uint8_t *buf, uint32_t len, uint8_t write)
+{
+  uint32_t i, n, skip = offset % BLOCK_SIZE;
+  struct extent ext;
+
+  for(i = offset / BLOCK_SIZE; len > 0; i += ext.length)
+  {
+    nextExtent(thisInode, i, blocksFor(skip + len), &ext);
+
+    uint8_t *block = pinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length, 0);
+    if(block == NULL) return -1;
+
+    block += skip;
+    n = ext.length * BLOCK_SIZE - skip;
+    if(n > len) n = len;
+
+    if(write)
+    {
+      memcpy(block, buf, n);
+      markDirty(block, n);
+    }
+    else memcpy(buf, block, n);
+    unpinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length);
+
+    buf += n;
+    len -= n;
+    skip = 0;
+  }
+  return 0;
+}
+
+int32_t findFreeInode()
+{
+  int32_t i;
+  for(i = 0; i < NUM_FILES; i++)
+    if(free_inodes[i]) return i;
+  
+  return -1;
+}
+
+//----------Block maps----------
+//Images with FS_FEATURE_INDIRECT keep DIRECT_BLOCKS block pointers in each inode, then the root
+//of a tree of blocks of pointers for each depth up to INDIRECT_LEVELS, see struct mapInode.
+//Blocks of pointers are data blocks claimed as a file grows into them and released with the
+//file's blocks, so a small file costs its 64 bytes of inode and nothing more. A deleted file
+//keeps pointing at them for undelete until a new file is committed to its inode. Pooled images
+//keep them pinned while they are in use, so fileBlock can read them without pinning.
+
+//What mapWalk does to each block of pointers
+#define MAP_CHECK   0  //Check that it is a free data block, for undelete
+#define MAP_CLAIM   1
+#define MAP_RELEASE 2
+#define MAP_PIN     3  //Pin it in a pooled image just opened
+
+//Claim a zeroed block of pointers. Returns it, or -1 if none is free or a pooled image can't
+//hold it
+int32_t claimMapBlock()
+{
+  int32_t block = allocBlock();
+  if(block == -1) return -1;
+
+  uint8_t *p = pinBlocks(FIRST_DATA_BLOCK + block, 1, 1);
+  if(p == NULL)
+  {
+    releaseBlock(block);
+    return -1;
+  }
+
+  memset(p, 0, BLOCK_SIZE);
+  markDirty(p, BLOCK_SIZE);
+  return block;
+}
+
+//Point file block idx of the inode at data block block, claiming the blocks of pointers on the
+//way that it doesn't have yet. Returns 0, or -1 if one couldn't be claimed
+int setFileBlock(struct inode *thisInode, uint32_t idx, int32_t block)
+{
+  if(!indirectInodes())
+  {
+    struct flatInode *node = thisInode->disk;
+    node->blocks[idx] = block;
+    markDirty(&node->blocks[idx], sizeof(int32_t));
+    return 0;
+  }
+
+  struct mapInode *node = thisInode->disk;
+  uint32_t *slot;
+
+  if(idx < DIRECT_BLOCKS) slot = &node->direct[idx];
+  else
+  {
+    uint64_t per = mapPointers(), span = per, pos = idx - DIRECT_BLOCKS;
+    uint32_t level = 0;
+    while(pos >= span)
+    {
+      pos -= span;
+      span *= per;
+      level++;
+    }
+
+    slot = &node->indirect[level];
+    do
+    {
+      if(*slot == 0)
+      {
+        int32_t map = claimMapBlock();
+        if(map == -1) return -1;
+        *slot = map + 1;
+        markDirty(slot, sizeof(uint32_t));
+      }
+
+      span /= per;
+      slot = (uint32_t *)blockData(FIRST_DATA_BLOCK + *slot - 1) + pos / span;
+      pos %= span;
+    } while(span > 1);
+  }
+
+  *slot = block + 1;
+  markDirty(slot, sizeof(uint32_t));
+  return 0;
+}
+
+//Do action to the block of pointers stored in ptr and the ones under it, which lead to count
+//file blocks through level levels of pointers. Returns 0, or -1 for a pointer past the data
+//blocks, a block MAP_CHECK finds in use, or one a pooled image can't read in
+int mapWalk(uint32_t ptr, uint32_t level, uint64_t count, int action)
+{
+  if(ptr == 0 || ptr > NUM_DATA_BLOCKS) return -1;
+
+  uint32_t i, block = ptr - 1;
+  uint64_t span = 1, n;
+  int ret = 0;
+
+  if(action == MAP_CHECK && !isBlockFree(block)) return -1;
+  if(action == MAP_CLAIM) claimBlock(block);
+
+  //Blocks in use are pinned already, the others are pinned for good once claimed, or while
+  //they are read when checking
+  uint32_t *p = (uint32_t *)blockData(FIRST_DATA_BLOCK + block);
+  if(action != MAP_RELEASE && pinBlocks(FIRST_DATA_BLOCK + block, 1, 0) == NULL) return -1;
+
+  for(i = 1; i < level; i++)
+    span *= mapPointers();
+  for(i = 0; level > 1 && count > 0 && ret == 0; i++, count -= n)
+  {
+    n = count < span ? count : span;
+    ret = mapWalk(p[i], level - 1, n, action);
+  }
+
+  if(action == MAP_CHECK || action == MAP_RELEASE) unpinBlocks(FIRST_DATA_BLOCK + block, 1);
+  if(action == MAP_RELEASE) releaseBlock(block);
+  return ret;
+}
+
+//Do action to every block of pointers leading to the first count blocks of a file
+//Returns 0 or -1, see mapWalk
+int mapFile(struct inode *thisInode, uint32_t count, int action)
+{
+  if(!indirectInodes() || count <= DIRECT_BLOCKS) return 0;
+
+  struct mapInode *node = thisInode->disk;
+  uint64_t per = mapPointers(), span = per, left = count - DIRECT_BLOCKS, n;
+  uint32_t level;
+
+  for(level = 0; level < INDIRECT_LEVELS && left > 0; level++, span *= per, left -= n)
+  {
+    n = left < span ? left : span;
+    if(mapWalk(node->indirect[level], level + 1, n, action) == -1) return -1;
+  }
+  return 0;
+}
+
+//Forget the blocks of pointers of an inode given to a new file, which belong to no file now
+void clearMap(struct inode *thisInode)
+{
+  if(!indirectInodes()) return;
+
+  struct mapInode *node = thisInode->disk;
+  memset(node->indirect, 0, sizeof(node->indirect));
+  markDirty(node->indirect, sizeof(node->indirect));
+}
+
+//Bytes an inode takes in the image's inode table
+static inline size_t diskInodeSize()
+{
+  return indirectInodes() ? sizeof(struct mapInode) : sizeof(struct flatInode);
+}
+
+//Put the inode back in the table as copy holds it, from before a file was reserved in it, and
+//reload it from there
+void restoreInode(int32_t inode, uint8_t *copy)
+{
+  memcpy(inodes[inode].disk, copy, diskInodeSize());
+  markDirty(inodes[inode].disk, diskInodeSize());
+  loadInodes(inode, 1);
+}
+
+//Let go of the first count blocks of a file and the blocks of pointers leading to them
+//The inode keeps pointing at them, for undelete
+void releaseFileBlocks(struct inode *thisInode, uint32_t count)
+{
+  uint32_t i;
+  for(i = 0; i < count; i++)
+    releaseBlock(fileBlock(thisInode, i));
+  mapFile(thisInode, count, MAP_RELEASE);
+}
+
+//Pin the blocks of pointers of every inode in use of a newly opened pooled image
+//Returns 0, or -1 if one couldn't be read in
+int pinMaps()
+{
+  uint32_t i;
+  if(!image_pooled || !indirectInodes()) return 0;
+
+  for(i = 0; i < NUM_FILES; i++)
+    if(inodes[i].in_use && mapFile(&inodes[i], storedBlocks(&inodes[i]), MAP_PIN) == -1) return -1;
+  return 0;
+}
+
+//Give the inode count blocks from file block first on, in as few contiguous runs as possible
+//Caller must check that enough blocks are free, blocks of pointers included, see mapBlocksFor
+void allocFileBlocks(uint32_t inode, uint32_t first, uint32_t count)
+{
+  uint32_t start, len, i;
+  while(count > 0)
+  {
+    len = findFreeRun(count, &start);
+    for(i = 0; i < len; i++)
+      claimBlock(start + i);
+
+    //Blocks of pointers it takes come after the run
+    for(i = 0; i < len; i++)
+      setFileBlock(&inodes[inode], first + i, start + i);
+
+    first += len;
+    count -= len;
+  }
+}
+
+//Give the inode count more blocks from file block first on when the caller only holds meta_lock
+//shared. Returns FS_OK, or FS_ENOSPC without claiming anything
+int growFile(uint32_t inode, uint32_t first, uint32_t count)
+{
+  pthread_mutex_lock(&alloc_lock);
+  if(count + mapBlocksFor(first + count) - mapBlocksFor(first) > free_block_count)
+  {
+    pthread_mutex_unlock(&alloc_lock);
+    return FS_ENOSPC;
+  }
+  allocFileBlocks(inode, first, count);
+  pthread_mutex_unlock(&alloc_lock);
+  return FS_OK;
+}
+
+//----------Compression----------
+//A file with the COMPRESSED_ATTR bit holds a packed stream in its blocks instead of its bytes: a
+//packHeader, the end offset of every chunk counted from the end of that table, then the chunks.
+//Each PACK_CHUNK bytes of the file is compressed on its own with the LZ codec below, or kept as
+//is when that doesn't make it smaller, so reads only decompress the chunks they touch.
+struct packHeader {
+  uint32_t magic;
+  uint32_t stored_size;  //Bytes of the whole stream, header included
+  uint32_t chunk_size;
+  uint32_t chunks;
+};
+
+//Compressed chunks collected in memory until the file's blocks are claimed
+struct packer {
+  uint8_t  *out;
+  uint32_t  cap;     //Bytes out has room for, it grows as the stream does
+  uint32_t  used;
+  uint32_t *ends;
+  uint32_t  chunks;
+  uint32_t  size;    //Bytes of file data packed so far
+};
+
+static inline uint32_t lzRead32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t lzHash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//Write the part of a sequence length that didn't fit its nibble
+static inline uint8_t *lzPutLength(uint8_t *op, uint32_t len)
+{
+  while(len >= 255)
+  {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+//LZ77 in LZ4 style sequences: a token holding the literal and match lengths in its nibbles,
+//with 255 continued bytes for longer ones, the literals, then a 2 byte match offset.
+//The last sequence is literals only. Returns the compressed size, or 0 if it needs more than cap
+uint32_t lzCompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap)
+{
+  uint32_t table[1 << LZ_HASH_BITS];
+  uint32_t ip = 0, anchor = 0, ref, lit, mlen, v, h;
+  size_t out = 0;
+
+  memset(table, 0, sizeof(table));
+
+  while(len >= 4 && ip <= len - 4)
+  {
+    v = lzRead32(src + ip);
+    h = lzHash(v);
+    ref = table[h];
+    table[h] = ip;
+
+    if(ref >= ip || ip - ref > 0xffff || lzRead32(src + ref) != v)
+    {
+      //Step faster through input that keeps not matching
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    //Grow the match forwards, then backwards over literals that match too
+    mlen = 4;
+    while(ip + mlen < len && src[ref + mlen] == src[ip + mlen]) mlen++;
+    while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+    {
+      ip--;
+      ref--;
+      mlen++;
+    }
+
+    lit = ip - anchor;
+    if(out + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > cap) return 0;
+
+    uint8_t *op = dst + out, *token = op++;
+    *token = (lit < 15 ? lit : 15) << 4 | (mlen - 4 < 15 ? mlen - 4 : 15);
+    if(lit >= 15) op = lzPutLength(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    *op++ = (ip - ref) & 0xff;
+    *op++ = (ip - ref) >> 8;
+    if(mlen - 4 >= 15) op = lzPutLength(op, mlen - 19);
+    out = op - dst;
+
+    ip += mlen;
+    anchor = ip;
+
+    //The bytes just before the next position often start the next match
+    if(ip <= len - 2) table[lzHash(lzRead32(src + ip - 2))] = ip - 2;
+  }
+
+  lit = len - anchor;
+  if(out + 1 + lit / 255 + 1 + lit > cap) return 0;
+
+  uint8_t *op = dst + out;
+  *op++ = (lit < 15 ? lit : 15) << 4;
+  if(lit >= 15) op = lzPutLength(op, lit - 15);
+  memcpy(op, src + anchor, lit);
+  op += lit;
+
+  return op - dst;
+}
+
+//Read the part of a sequence length past its nibble. Returns the new input position or NULL
+static inline const uint8_t *lzGetLength(const uint8_t *ip, const uint8_t *end, uint32_t *len)
+{
+  uint8_t b;
+  do
+  {
+    if(ip == end) return NULL;
+    b = *ip++;
+    *len += b;
+  } while(b == 255);
+  return ip;
+}
+
+//Decompress slen bytes of src into exactly len bytes of dst. Returns 0, or -1 if src is corrupt
+int lzDecompress(const uint8_t *src, uint32_t slen, uint8_t *dst, uint32_t len)
+{
+  const uint8_t *ip = src, *end = src + slen;
+  uint32_t op = 0, lit, mlen, off, i;
+
+  while(ip < end)
+  {
+    uint8_t token = *ip++;
+
+    lit = token >> 4;
+    if(lit == 15 && (ip = lzGetLength(ip, end, &lit)) == NULL) return -1;
+    if(lit > (uint32_t)(end - ip) || lit > len - op) return -1;
+    memcpy(dst + op, ip, lit);
+    ip += lit;
+    op += lit;
+
+    if(ip == end) break;
+
+    if(end - ip < 2) return -1;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+
+    mlen = (token & 15) + 4;
+    if(mlen == 19 && (ip = lzGetLength(ip, end, &mlen)) == NULL) return -1;
+    if(off == 0 || off > op || mlen > len - op) return -1;
+
+    //Matches closer than their length repeat themselves, copy those a byte at a time
+    if(off >= mlen) memcpy(dst + op, dst + op - off, mlen);
+    else for(i = 0; i < mlen; i++) dst[op + i] = dst[op + i - off];
+    op += mlen;
+  }
+
+  return op == len ? 0 : -1;
+}
+
+//Returns FS_OK or FS_ENOMEM
+int packBegin(struct packer *p)
+{
+  memset(p, 0, sizeof(*p));
+  p->cap = PACK_CHUNK;
+  p->out = malloc(p->cap);
+  return p->out == NULL ? FS_ENOMEM : FS_OK;
+}
+
+void packEnd(struct packer *p)
+{
+  free(p->out);
+  free(p->ends);
+}
+
+//Bytes the packed stream takes in the file
+uint64_t packSize(struct packer *p)
+{
+  return sizeof(struct packHeader) + (uint64_t)p->chunks * sizeof(uint32_t) + p->used;
+}
+
+//Compress the next len bytes of the file, at most PACK_CHUNK, onto the stream
+//Returns FS_OK, FS_EFBIG once the stream won't fit in a file, or FS_ENOMEM
+int packChunk(struct packer *p, const uint8_t *buf, uint32_t len)
+{
+  if(len > UINT32_MAX - p->size) return FS_EFBIG;
+
+  if(p->chunks % 1024 == 0)
+  {
+    uint32_t *ends = realloc(p->ends, (p->chunks + 1024) * sizeof(uint32_t));
+    if(ends == NULL) return FS_ENOMEM;
+    p->ends = ends;
+  }
+
+  //The chunk's table entry has to fit as well
+  int64_t room = (int64_t)MAX_FILE_SIZE - packSize(p) - sizeof(uint32_t);
+  if(room <= 0) return FS_EFBIG;
+
+  //Files can be far bigger than their streams usually get, so the buffer grows as needed
+  if(p->cap - p->used < len)
+  {
+    uint64_t cap = (uint64_t)p->cap * 2 > (uint64_t)p->used + len ? (uint64_t)p->cap * 2 : (uint64_t)p->used + len;
+    uint8_t *out = cap > UINT32_MAX ? NULL : realloc(p->out, cap);
+    if(out == NULL) return FS_ENOMEM;
+    p->out = out;
+    p->cap = cap;
+  }
+
+  uint32_t n = lzCompress(buf, len, p->out + p->used, room < len ? room : len - 1);
+  if(n == 0)
+  {
+    if(len > room) return FS_EFBIG;
+    memcpy(p->out + p->used, buf, len);
+    n = len;
+  }
+
+  p->used += n;
+  p->ends[p->chunks++] = p->used;
+  p->size += len;
+  return FS_OK;
+}
+
+//Claim blocks for the packed stream and write it to an inode that holds none
+//Caller must check that enough blocks are free. Returns 0, or -1 if a pooled image couldn't be read
+int packStore(struct packer *p, uint32_t inode)
+{
+  struct packHeader hdr;
+  hdr.magic = PACK_MAGIC;
+  hdr.stored_size = packSize(p);
+  hdr.chunk_size = PACK_CHUNK;
+  hdr.chunks = p->chunks;
+
+  uint32_t table = sizeof(hdr), base = table + p->chunks * sizeof(uint32_t);
+
+  allocFileBlocks(inode, 0, blocksFor(hdr.stored_size));
+  if(copyFileData(&inodes[inode], 0, (uint8_t *)&hdr, sizeof(hdr), 1) == -1 ||
+     copyFileData(&inodes[inode], table, (uint8_t *)p->ends, base - table, 1) == -1 ||
+     copyFileData(&inodes[inode], base, p->out, p->used, 1) == -1)
+    return -1;
+  return 0;
+}
+
+//Read and check the header of a compressed file. Returns 0, or -1 if it doesn't fit the file
+int packHeaderRead(struct inode *thisInode, struct packHeader *hdr)
+{
+  if(copyFileData(thisInode, 0, (uint8_t *)hdr, sizeof(*hdr), 0) == -1) return -1;
+
+  if(hdr->magic != PACK_MAGIC || hdr->chunk_size != PACK_CHUNK) return -1;
+  if(hdr->chunks != (thisInode->file_size + (uint64_t)PACK_CHUNK - 1) / PACK_CHUNK) return -1;
+  if(hdr->stored_size > MAX_FILE_SIZE) return -1;
+  if(hdr->stored_size < sizeof(*hdr) + (uint64_t)hdr->chunks * sizeof(uint32_t)) return -1;
+  return 0;
+}
+
+//Number of bytes the inode holds in its blocks, the packed stream's for compressed files
+uint32_t storedSize(struct inode *thisInode)
+{
+  if(!(thisInode->attribute & (1 << COMPRESSED_ATTR))) return thisInode->file_size;
+
+  //A damaged header still owns the block it is in
+  struct packHeader hdr;
+  if(packHeaderRead(thisInode, &hdr) == -1) return BLOCK_SIZE;
+  return hdr.stored_size;
+}
+
+//Number of blocks the inode holds
+uint32_t storedBlocks(struct inode *thisInode)
+{
+  return blocksFor(storedSize(thisInode));
+}
+
+//Copy len bytes of a compressed file from offset into buf, decompressing the chunks they are in
+//The range must lie within the file. Returns 0, or -1 if the stream is damaged or can't be read
+int unpackRange(struct inode *thisInode, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+  struct packHeader hdr;
+  if(packHeaderRead(thisInode, &hdr) == -1) return -1;
+
+  uint32_t table = sizeof(hdr), base = table + hdr.chunks * sizeof(uint32_t);
+  uint32_t bounds[2], c, skip, clen, n;
+  uint8_t *packed = malloc(PACK_CHUNK), *chunk = malloc(PACK_CHUNK);
+  int ret = -1, failed;
+
+  if(packed == NULL || chunk == NULL) goto out;
+
+  while(len > 0)
+  {
+    c = offset / PACK_CHUNK;
+    skip = offset % PACK_CHUNK;
+    clen = thisInode->file_size - c * PACK_CHUNK;
+    if(clen > PACK_CHUNK) clen = PACK_CHUNK;
+    n = clen - skip;
+    if(n > len) n = len;
+
+    //Where the chunk starts is where the one before it ends
+    bounds[0] = 0;
+    if(c == 0) failed = copyFileData(thisInode, table, (uint8_t *)&bounds[1], sizeof(uint32_t), 0);
+    else failed = copyFileData(thisInode, table + (c - 1) * sizeof(uint32_t), (uint8_t *)bounds, 2 * sizeof(uint32_t), 0);
+    if(failed || bounds[0] > bounds[1] || bounds[1] - bounds[0] > clen || bounds[1] > hdr.stored_size - base) goto out;
+
+    if(bounds[1] - bounds[0] == clen)
+    {
+      if(copyFileData(thisInode, base + bounds[0] + skip, buf, n, 0) == -1) goto out;
+    }
+    else
+    {
+      if(copyFileData(thisInode, base + bounds[0], packed, bounds[1] - bounds[0], 0) == -1) goto out;
+      if(lzDecompress(packed, bounds[1] - bounds[0], chunk, clen) == -1) goto out;
+      memcpy(buf, chunk + skip, n);
+    }
+
+    buf += n;
+    offset += n;
+    len -= n;
+  }
+  ret = 0;
+
+out:
+  free(packed);
+  free(chunk);
+  return ret;
+}
+
+//Write a whole compressed file to out. Returns FS_OK, FS_EIO if out can't be written,
+//FS_ENOMEM or FS_EBADIMG if the stream is damaged
+int unpackTo(struct inode *thisInode, int out)
+{
+  uint8_t *buf = malloc(PACK_CHUNK);
+  uint32_t pos, n;
+  int ret = FS_OK;
+
+  if(buf == NULL) return FS_ENOMEM;
+
+  for(pos = 0; pos < thisInode->file_size && ret == FS_OK; pos += n)
+  {
+    n = thisInode->file_size - pos;
+    if(n > PACK_CHUNK) n = PACK_CHUNK;
+
+    if(unpackRange(thisInode, pos, buf, n) == -1) ret = FS_EBADIMG;
+    else if(writeFully(out, buf, n) == -1) ret = FS_EIO;
+  }
+
+  free(buf);
+  return ret;
+}
+
+//Pack the input into newly claimed blocks of the inode, for insert -c
+//Returns the number of bytes of input stored, or -1 with nothing claimed
+int64_t packIn(int fd, uint32_t inode)
+{
+  struct packer p;
+  uint8_t *buf = malloc(PACK_CHUNK);
+  int64_t stored = -1;
+  uint32_t count;
+  ssize_t n;
+  int ret;
+
+  if(buf == NULL || packBegin(&p) != FS_OK)
+  {
+    fsError("Not enough memory to compress the file\n");
+    free(buf);
+    return -1;
+  }
+
+  do
+  {
+    n = readFully(fd, buf, PACK_CHUNK);
+    if(n == -1)
+    {
+      fsError("An error occured reading from the input file.\n");
+      goto out;
+    }
+    if(n == 0) break;
+
+    ret = packChunk(&p, buf, n);
+    if(ret == FS_EFBIG)
+    {
+      fsError("File exceeds max filesize even compressed\n");
+      goto out;
+    }
+    if(ret != FS_OK)
+    {
+      fsError("Not enough memory to compress the file\n");
+      goto out;
+    }
+  } while(n == PACK_CHUNK);
+
+  count = blocksFor(packSize(&p));
+  if(count + mapBlocksFor(count) > free_block_count)
+  {
+    fsError("Not enough free space\n");
+    goto out;
+  }
+
+  if(packStore(&p, inode) == -1)
+  {
+    fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+    releaseFileBlocks(&inodes[inode], count);
+    goto out;
+  }
+  stored = p.size;
+
+out:
+  packEnd(&p);
+  free(buf);
+  return stored;
+}
+
+//Replace a file's blocks with a packed stream of its contents, unless that saves nothing
+//Caller holds meta_lock exclusive. Returns FS_OK, PACK_NO_GAIN, FS_EFBIG, FS_ENOSPC, FS_ENOMEM or FS_EIO
+int compressFile(uint32_t inode)
+{
+  struct inode *thisInode = &inodes[inode];
+  if(thisInode->attribute & (1 << COMPRESSED_ATTR)) return FS_OK;
+
+  struct packer p;
+  uint8_t *buf = malloc(PACK_CHUNK);
+  uint32_t pos, n, size = thisInode->file_size;
+  int ret = FS_ENOMEM;
+
+  if(buf == NULL || packBegin(&p) != FS_OK)
+  {
+    free(buf);
+    return FS_ENOMEM;
+  }
+
+  for(pos = 0, ret = FS_OK; pos < size && ret == FS_OK; pos += n)
+  {
+    n = size - pos;
+    if(n > PACK_CHUNK) n = PACK_CHUNK;
+
+    if(copyFileData(thisInode, pos, buf, n, 0) == -1) ret = FS_EIO;
+    else ret = packChunk(&p, buf, n);
+  }
+
+  //Packing can only take fewer blocks, so the old ones are enough to hold it
+  if(ret == FS_EFBIG || (ret == FS_OK && blocksFor(packSize(&p)) >= blocksFor(size))) ret = PACK_NO_GAIN;
+
+  //Blocks shared with other files or snapshots stay in use, so the packed copy may not fit
+  uint32_t have = blocksFor(size), need = blocksFor(packSize(&p));
+  if(ret == FS_OK && need + mapBlocksFor(need) > free_block_count + unsharedBlocks(thisInode, have) + mapBlocksFor(have))
+    ret = FS_ENOSPC;
+  if(ret == FS_OK)
+  {
+    releaseFileBlocks(thisInode, have);
+    clearMap(thisInode);
+
+    if(packStore(&p, inode) == -1) ret = FS_EIO;
+    thisInode->attribute |= 1 << COMPRESSED_ATTR;
+    storeInode(thisInode);
+  }
+
+  packEnd(&p);
+  free(buf);
+  return ret;
+}
+
+//Store a compressed file's contents as plain blocks again
+//Caller holds meta_lock exclusive. Returns FS_OK, FS_EFBIG, FS_ENOSPC, FS_ENOMEM, FS_EBADIMG or FS_EIO
+int expandFile(uint32_t inode)
+{
+  struct inode *thisInode = &inodes[inode];
+  if(!(thisInode->attribute & (1 << COMPRESSED_ATTR))) return FS_OK;
+
+  uint32_t size = thisInode->file_size, have = storedBlocks(thisInode), need = blocksFor(size);
+  if(size > MAX_FILE_SIZE) return FS_EFBIG;
+  if(need + mapBlocksFor(need) > free_block_count + unsharedBlocks(thisInode, have) + mapBlocksFor(have)) return FS_ENOSPC;
+
+  uint8_t *buf = malloc(size ? size : 1);
+  if(buf == NULL) return FS_ENOMEM;
+
+  if(unpackRange(thisInode, 0, buf, size) == -1)
+  {
+    free(buf);
+    return FS_EBADIMG;
+  }
+
+  releaseFileBlocks(thisInode, have);
+  clearMap(thisInode);
+
+  allocFileBlocks(inode, 0, need);
+  int ret = copyFileData(thisInode, 0, buf, size, 1) == -1 ? FS_EIO : FS_OK;
+  thisInode->attribute &= ~(1 << COMPRESSED_ATTR);
+  storeInode(thisInode);
+
+  free(buf);
+  return ret;
+}
+
+//----------Deduplication----------
+//With FS_FEATURE_DEDUP on, each block of a newly inserted file is looked up by a fingerprint of
+//its contents, and a block that matches one already in the image is replaced by a reference to
+//it. Shared blocks count their owners in free_blocks and are copied before any file changes them
+//in place. The index only lives in memory and is rebuilt on open. Its entries go stale as blocks
+//are freed or rewritten, so a match is always confirmed byte for byte before it is shared.
+struct fingerprint {
+  uint64_t hash;
+  int32_t  block;  //-1 for an empty slot
+};
+
+struct fingerprint *fingerprints;
+uint32_t fingerprint_mask;
+uint32_t fingerprint_used;
+
+void dropFingerprints()
+{
+  free(fingerprints);
+  fingerprints = NULL;
+  fingerprint_mask = 0;
+  fingerprint_used = 0;
+}
+
+//Fingerprint of a data block's contents, 0 for one that can't be read
+uint64_t blockHash(uint32_t block)
+{
+  uint8_t *buf = pinBlocks(FIRST_DATA_BLOCK + block, 1, 0);
+  if(buf == NULL) return 0;
+
+  uint64_t hash = checksum(buf, BLOCK_SIZE, 14695981039346656037ULL);
+  unpinBlocks(FIRST_DATA_BLOCK + block, 1);
+  return hash;
+}
+
+//Whether two data blocks hold the same bytes, never for blocks that can't be read
+uint8_t blocksEqual(uint32_t a, uint32_t b)
+{
+  uint8_t *pa = pinBlocks(FIRST_DATA_BLOCK + a, 1, 0), *pb = pinBlocks(FIRST_DATA_BLOCK + b, 1, 0);
+  uint8_t same = pa != NULL && pb != NULL && memcmp(pa, pb, BLOCK_SIZE) == 0;
+
+  if(pa != NULL) unpinBlocks(FIRST_DATA_BLOCK + a, 1);
+  if(pb != NULL) unpinBlocks(FIRST_DATA_BLOCK + b, 1);
+  return same;
+}
+
+//The slot holding hash, or the empty one it would go in
+struct fingerprint *fingerprintSlot(uint64_t hash)
+{
+  //FNV's low bits only see the low bits of the input, fold the high half in
+  uint32_t i = (hash ^ hash >> 32) & fingerprint_mask;
+  while(fingerprints[i].block != -1 && fingerprints[i].hash != hash)
+    i = (i + 1) & fingerprint_mask;
+  return &fingerprints[i];
+}
+
+//Record that block holds contents with the given fingerprint. Returns FS_OK or FS_ENOMEM
+int fingerprintAdd(uint64_t hash, uint32_t block)
+{
+  //Resize at half full, leaving out entries whose blocks have been freed since
+  if(fingerprints == NULL || fingerprint_used >= (fingerprint_mask + 1) / 2)
+  {
+    struct fingerprint *old = fingerprints;
+    uint32_t i, live = 0, old_size = old ? fingerprint_mask + 1 : 0, size = 1024;
+
+    for(i = 0; i < old_size; i++)
+      if(old[i].block != -1 && !isBlockFree(old[i].block)) live++;
+    while(size < 4 * (live + 1)) size <<= 1;
+
+    fingerprints = malloc(size * sizeof(struct fingerprint));
+    if(fingerprints == NULL)
+    {
+      fingerprints = old;
+      return FS_ENOMEM;
+    }
+    for(i = 0; i < size; i++)
+      fingerprints[i].block = -1;
+    fingerprint_mask = size - 1;
+    fingerprint_used = 0;
+
+    for(i = 0; i < old_size; i++)
+    {
+      if(old[i].block == -1 || isBlockFree(old[i].block)) continue;
+      *fingerprintSlot(old[i].hash) = old[i];
+      fingerprint_used++;
+    }
+    free(old);
+  }
+
+  struct fingerprint *slot = fingerprintSlot(hash);
+  if(slot->block == -1) fingerprint_used++;
+  slot->hash = hash;
+  slot->block = block;
+  return FS_OK;
+}
+
+//Index every block in use, for an image opened or switched to dedup mode
+//Returns FS_OK or FS_ENOMEM
+int buildFingerprints()
+{
+  uint32_t block;
+  dropFingerprints();
+
+  for(block = nextFreeMapBit(0, 0); block < NUM_DATA_BLOCKS; block = nextFreeMapBit(block + 1, 0))
+    if(fingerprintAdd(blockHash(block), block) != FS_OK) return FS_ENOMEM;
+
+  return FS_OK;
+}
+
+//Replace blocks of a newly written file with identical ones already in the image, freeing its
+//own copies, and index the rest. Caller holds meta_lock exclusive
+void dedupFile(uint32_t inode)
+{
+  struct inode *thisInode = &inodes[inode];
+  uint32_t i, size = storedSize(thisInode), count = blocksFor(size);
+
+  //Whatever follows the end of the file in its last block would keep files that end the same apart
+  if(size % BLOCK_SIZE)
+  {
+    uint8_t *last = pinBlocks(FIRST_DATA_BLOCK + fileBlock(thisInode, count - 1), 1, 0);
+    if(last == NULL) return;
+
+    memset(last + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+    markDirty(last, BLOCK_SIZE);
+    unpinBlocks(FIRST_DATA_BLOCK + fileBlock(thisInode, count - 1), 1);
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    uint32_t block = fileBlock(thisInode, i);
+    uint64_t hash = blockHash(block);
+
+    if(fingerprints != NULL)
+    {
+      int32_t match = fingerprintSlot(hash)->block;
+      if(match != -1 && (uint32_t)match != block && !isBlockFree(match) && blockRefs(match) < 255 &&
+         blocksEqual(match, block))
+      {
+        setBlockRefs(match, blockRefs(match) + 1);
+        setFileBlock(thisInode, i, match);
+
+        //The copy is free again and its contents never need saving
+        releaseBlock(block);
+        markClean(FIRST_DATA_BLOCK + block);
+        continue;
+      }
+    }
+
+    //Dedup is best effort, a block that can't be indexed just isn't shared
+    fingerprintAdd(hash, block);
+  }
+}
+
+//Give the inode its own copy of each shared block from file block first on, before it is changed
+//in place. Caller holds the inode's lock exclusive. Returns FS_OK, or FS_ENOSPC once no block is
+//free or FS_EIO if one of a pooled image can't be read, leaving the rest shared
+int unshareBlocks(uint32_t inode, uint32_t first, uint32_t count)
+{
+  uint32_t i, refs;
+  int ret = FS_OK;
+
+  if(!(sb.features & FS_FEATURE_REFCOUNT)) return FS_OK;
+
+  pthread_mutex_lock(&alloc_lock);
+  for(i = first; i < first + count; i++)
+  {
+    uint32_t block = fileBlock(&inodes[inode], i);
+    refs = blockRefs(block);
+    if(refs < 2) continue;
+
+    int32_t copy = allocBlock();
+    if(copy == -1)
+    {
+      ret = FS_ENOSPC;
+      break;
+    }
+
+    uint8_t *src = pinBlocks(FIRST_DATA_BLOCK + block, 1, 0);
+    uint8_t *dst = src ? pinBlocks(FIRST_DATA_BLOCK + copy, 1, 1) : NULL;
+    if(dst == NULL)
+    {
+      if(src != NULL) unpinBlocks(FIRST_DATA_BLOCK + block, 1);
+      releaseBlock(copy);
+      ret = FS_EIO;
+      break;
+    }
+
+    memcpy(dst, src, BLOCK_SIZE);
+    markDirty(dst, BLOCK_SIZE);
+    unpinBlocks(FIRST_DATA_BLOCK + block, 1);
+    unpinBlocks(FIRST_DATA_BLOCK + copy, 1);
+
+    setBlockRefs(block, refs - 1);
+    setFileBlock(&inodes[inode], i, copy);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+
+  return ret;
+}
+
+//Turn dedup on or off for the open image, or report whether it is on when mode is NULL
+//Turning it on for the first time marks the image as holding reference counts for good
+void setDedup(char *mode)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  if(!image_open)
+  {
+    fsError("No image open\n");
+    goto out;
+  }
+
+  if(mode == NULL)
+  {
+    printf("Dedup is %s for %s\n", (sb.features & FS_FEATURE_DEDUP) ? "on" : "off", image_name);
+    goto out;
+  }
+
+  if(strcmp(mode, "on") != 0 && strcmp(mode, "off") != 0)
+  {
+    fsError("Incorrect parameters. Ex: dedup [on|off]\n");
+    goto out;
+  }
+
+  //The setting is kept in the superblock, which images from before it don't have
+  if(sb.magic != FS_MAGIC)
+  {
+    fsError("Image %s predates dedup support, copy its files to a new image to use it\n", image_name);
+    goto out;
+  }
+
+  if(strcmp(mode, "on") == 0)
+  {
+    if(buildFingerprints() != FS_OK)
+    {
+      dropFingerprints();
+      fsError("Not enough memory to index image %s\n", image_name);
+      goto out;
+    }
+    sb.features |= FS_FEATURE_DEDUP | FS_FEATURE_REFCOUNT;
+  }
+  else
+  {
+    dropFingerprints();
+    sb.features &= ~FS_FEATURE_DEDUP;
+  }
+
+  memcpy(data, &sb, sizeof(sb));
+  markDirty(data, sizeof(sb));
+
+out:
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//----------Snapshots----------
+//A snapshot records the files of the image as they were: the name, attributes, size and block
+//extents of each, kept in a file of its own whose directory entry is marked SNAPSHOT_ENTRY instead
+//of in use, so lookups, list and undelete pass it by. Every block it records holds a reference in
+//free_blocks, the counts dedup keeps, and files already copy a shared block before changing it in
+//place, so taking a snapshot only writes its own few blocks. rollback puts the recorded files
+//back, and clone shares a file's blocks with a new file the same way.
+struct snapHeader {
+  uint32_t magic;
+  uint32_t files;
+  uint32_t blocks;  //Blocks listed by all the files, a block counted once per listing
+  int64_t  taken;   //time() when the snapshot was taken
+};
+
+//Each file's snapFile is followed by its extents
+struct snapFile {
+  char     filename[64];
+  uint32_t file_size;
+  uint32_t extents;
+  uint8_t  attribute;
+  uint8_t  unused;
+  uint16_t depth;  //Directories above the file in images with directories, which come before their files
+};
+
+//Number of extents holding the first count blocks of a file
+uint32_t extentCount(struct inode *thisInode, uint32_t count)
+{
+  uint32_t i, n = 0;
+  struct extent ext;
+  for(i = 0; i < count; i += ext.length, n++)
+    nextExtent(thisInode, i, count - i, &ext);
+  return n;
+}
+
+//Where a walk of the directory tree is in one directory
+struct dirCursor {
+  uint32_t dir;
+  uint32_t block;
+  uint32_t pos;
+};
+
+//Fill order with the directory entries of the files in use, in the order a snapshot records them,
+//and depth with how deep each is. Images with directories are walked depth first so every
+//directory comes right before its files. Returns how many, or -1 if out of memory
+int32_t snapshotOrder(int32_t *order, uint16_t *depth)
+{
+  int32_t i, n = 0;
+  if(!treeDirs())
+  {
+    for(i = 0; i < NUM_FILES; i++)
+    {
+      if(directory[i].in_use != 1) continue;
+      order[n] = i;
+      depth[n++] = 0;
+    }
+    return n;
+  }
+
+  //One cursor for each directory on the way down from the root
+  struct dirCursor *stack = malloc((NUM_FILES + 1) * sizeof(struct dirCursor));
+  struct dirRecord *rec;
+  uint32_t top = 0;
+  if(stack == NULL) return -1;
+
+  stack[0].dir = ROOT_DIR;
+  indexSeek(ROOT_DIR, "", &stack[0].block, &stack[0].pos);
+  while(1)
+  {
+    struct dirCursor *cur = &stack[top];
+    rec = indexAt(&cur->block, &cur->pos);
+    if(rec == NULL || rec->parent != cur->dir)
+    {
+      if(top-- == 0) break;
+      continue;
+    }
+    cur->pos++;
+    if(directory[rec->entry].in_use != 1) continue;
+
+    order[n] = rec->entry;
+    depth[n++] = top;
+    if(isDirectory(rec->entry))
+    {
+      cur = &stack[++top];
+      cur->dir = rec->entry + 1;
+      indexSeek(cur->dir, "", &cur->block, &cur->pos);
+    }
+  }
+
+  free(stack);
+  return n;
+}
+
+//Record the files in use into a newly allocated buffer
+//Returns FS_OK, FS_ENOMEM, or FS_EFBIG if the record is more than a file can hold
+int snapshotPack(uint8_t **out, uint32_t *len)
+{
+  uint32_t i, j, *counts = calloc(NUM_FILES, sizeof(uint32_t));
+  int32_t *order = malloc(NUM_FILES * sizeof(int32_t)), files;
+  uint16_t *depth = malloc(NUM_FILES * sizeof(uint16_t));
+  uint64_t size = sizeof(struct snapHeader);
+  uint8_t *rec = NULL;
+  int ret = FS_ENOMEM;
+
+  if(counts == NULL || order == NULL || depth == NULL) goto out;
+  if((files = snapshotOrder(order, depth)) == -1) goto out;
+
+  //storedBlocks reads the header of compressed files, so it is only asked once
+  for(i = 0; i < (uint32_t)files; i++)
+  {
+    struct inode *thisInode = &inodes[directory[order[i]].inode];
+    counts[i] = storedBlocks(thisInode);
+    size += sizeof(struct snapFile) + extentCount(thisInode, counts[i]) * sizeof(struct extent);
+  }
+
+  if(size > MAX_FILE_SIZE) ret = FS_EFBIG;
+  else rec = calloc(size, 1);
+  if(rec == NULL) goto out;
+
+  struct snapHeader *hdr = (struct snapHeader *)rec;
+  uint8_t *pos = rec + sizeof(*hdr);
+  hdr->magic = SNAP_MAGIC;
+  hdr->taken = time(NULL);
+
+  for(i = 0; i < (uint32_t)files; i++)
+  {
+    struct inode *thisInode = &inodes[directory[order[i]].inode];
+    struct snapFile *file = (struct snapFile *)pos;
+    struct extent *ext = (struct extent *)(file + 1);
+
+    memcpy(file->filename, directory[order[i]].filename, 64);
+    file->file_size = thisInode->file_size;
+    file->attribute = thisInode->attribute;
+    file->depth = depth[i];
+    for(j = 0; j < counts[i]; j += ext[file->extents].length, file->extents++)
+      nextExtent(thisInode, j, counts[i] - j, &ext[file->extents]);
+
+    hdr->files++;
+    hdr->blocks += counts[i];
+    pos += sizeof(*file) + file->extents * sizeof(struct extent);
+  }
+
+  *out = rec;
+  *len = size;
+  ret = FS_OK;
+
+out:
+  free(counts);
+  free(order);
+  free(depth);
+  return ret;
+}
+
+//Read the record of the snapshot in directory entry snap into a newly allocated buffer, checking
+//that every file and extent in it lies within the record and the blocks in use
+//Returns FS_OK, FS_ENOMEM, FS_EIO, or FS_EBADIMG for a record that doesn't add up
+int snapshotLoad(int32_t snap, uint8_t **out)
+{
+  struct inode *thisInode = &inodes[directory[snap].inode];
+  uint32_t i, j, b, size = thisInode->file_size, blocks = 0, deepest = 0;
+  if(size < sizeof(struct snapHeader)) return FS_EBADIMG;
+
+  uint8_t *rec = malloc(size);
+  if(rec == NULL) return FS_ENOMEM;
+  if(copyFileData(thisInode, 0, rec, size, 0) == -1)
+  {
+    free(rec);
+    return FS_EIO;
+  }
+
+  struct snapHeader *hdr = (struct snapHeader *)rec;
+  uint32_t pos = sizeof(*hdr);
+  int ret = hdr->magic == SNAP_MAGIC ? FS_OK : FS_EBADIMG;
+
+  for(i = 0; ret == FS_OK && i < hdr->files; i++)
+  {
+    struct snapFile *file = (struct snapFile *)(rec + pos);
+    if(size - pos < sizeof(*file) || (size - pos - sizeof(*file)) / sizeof(struct extent) < file->extents)
+    {
+      ret = FS_EBADIMG;
+      break;
+    }
+    file->filename[63] = '\0';
+
+    //A file is at most one deeper than the directory before it
+    if(file->depth > deepest)
+    {
+      ret = FS_EBADIMG;
+      break;
+    }
+    deepest = file->depth + ((file->attribute >> DIRECTORY_ATTR) & 1);
+
+    //A file can't list more blocks than an inode holds, nor blocks that are free
+    struct extent *ext = (struct extent *)(file + 1);
+    uint32_t count = 0;
+    for(j = 0; ret == FS_OK && j < file->extents; j++)
+    {
+      if(ext[j].start < 0 || (uint32_t)ext[j].start >= NUM_DATA_BLOCKS ||
+         ext[j].length > NUM_DATA_BLOCKS - ext[j].start || ext[j].length > sb.blocks_per_file - count)
+        ret = FS_EBADIMG;
+      for(b = 0; ret == FS_OK && b < ext[j].length; b++)
+        if(isBlockFree(ext[j].start + b)) ret = FS_EBADIMG;
+      count += ext[j].length;
+    }
+
+    blocks += count;
+    pos += sizeof(*file) + file->extents * sizeof(struct extent);
+  }
+  if(ret == FS_OK && blocks != hdr->blocks) ret = FS_EBADIMG;
+
+  if(ret != FS_OK) free(rec);
+  else *out = rec;
+  return ret;
+}
+
+//Add a reference to each of the first count blocks a record lists, or with release drop one
+//Adding stops short of a block that already has 255 owners. Returns how many were done
+uint32_t snapshotRefs(uint8_t *rec, uint32_t count, uint8_t release)
+{
+  struct snapHeader *hdr = (struct snapHeader *)rec;
+  uint8_t *pos = rec + sizeof(*hdr);
+  uint32_t i, j, b, done = 0;
+
+  for(i = 0; i < hdr->files; i++)
+  {
+    struct snapFile *file = (struct snapFile *)pos;
+    struct extent *ext = (struct extent *)(file + 1);
+    pos += sizeof(*file) + file->extents * sizeof(struct extent);
+
+    for(j = 0; j < file->extents; j++)
+    {
+      for(b = ext[j].start; b < ext[j].start + ext[j].length; b++, done++)
+      {
+        if(done == count) return done;
+        if(release) releaseBlock(b);
+        else if(blockRefs(b) == 255) return done;
+        else setBlockRefs(b, blockRefs(b) + 1);
+      }
+    }
+  }
+  return done;
+}
+
+//Add a reference to every block a record lists, or none of them
+//Returns FS_OK, or BLOCK_REFS_FULL if a block already has 255 owners
+int snapshotShare(uint8_t *rec)
+{
+  uint32_t blocks = ((struct snapHeader *)rec)->blocks;
+  uint32_t done = snapshotRefs(rec, blocks, 0);
+  if(done == blocks) return FS_OK;
+
+  snapshotRefs(rec, done, 1);
+  return BLOCK_REFS_FULL;
+}
+
+//Whether the record of the snapshot in directory entry snap lists data block block
+uint8_t snapshotHolds(int32_t snap, uint32_t block)
+{
+  uint8_t *rec;
+  if(snapshotLoad(snap, &rec) != FS_OK) return 0;
+
+  struct snapHeader *hdr = (struct snapHeader *)rec;
+  uint8_t *pos = rec + sizeof(*hdr);
+  uint32_t i, j, found = 0;
+
+  for(i = 0; i < hdr->files && !found; i++)
+  {
+    struct snapFile *file = (struct snapFile *)pos;
+    struct extent *ext = (struct extent *)(file + 1);
+    pos += sizeof(*file) + file->extents * sizeof(struct extent);
+
+    for(j = 0; j < file->extents; j++)
+      if(block >= (uint32_t)ext[j].start && block - ext[j].start < ext[j].length) found = 1;
+  }
+
+  free(rec);
+  return found;
+}
+
+//Mark the image as holding snapshots or shared blocks, which older builds must not open
+void setFeatures(uint32_t features)
+{
+  if((sb.features & features) == features) return;
+
+  sb.features |= features;
+  memcpy(data, &sb, sizeof(sb));
+  markDirty(data, sizeof(sb));
+}
+
+//Let go of the blocks and inode of the file or snapshot in directory entry entry, and clear the
+//entry so it can't be undeleted
+void dropEntry(int32_t entry)
+{
+  if(directory[entry].in_use)
+  {
+    int32_t inode = directory[entry].inode;
+    uint32_t count = directory[entry].in_use == SNAPSHOT_ENTRY ? blocksFor(inodes[inode].file_size) :
+                     storedBlocks(&inodes[inode]);
+    releaseFileBlocks(&inodes[inode], count);
+
+    inodes[inode].in_use = 0;
+    storeInode(&inodes[inode]);
+    free_inodes[inode] = 1;
+    markDirty(&free_inodes[inode], 1);
+  }
+
+  if(directory[entry].filename[0] != '\0') nameRemove(entry);
+  memset(&directory[entry], 0, sizeof(struct directoryEntry));
+  markDirty(&directory[entry], sizeof(struct directoryEntry));
+}
+
+//Record the files in use as a snapshot named name. Caller holds meta_lock exclusive
+//Returns FS_OK, FS_EEXIST, FS_EINVAL for a name that can't be used, FS_EFBIG, FS_ENOSPC, FS_ENFILE,
+//FS_ENOMEM, FS_EIO or BLOCK_REFS_FULL
+int takeSnapshot(char *name)
+{
+  //Snapshots are looked up by the whole name, so it has to fit in the entry as given
+  if(name[0] == '\0' || strlen(name) > 63 || strchr(name, '/') != NULL) return FS_EINVAL;
+  if(findEntry(name, SNAPSHOT_ENTRY) != -1) return FS_EEXIST;
+
+  uint8_t *rec;
+  uint32_t size;
+  int32_t entry, inode;
+  int ret = snapshotPack(&rec, &size);
+  if(ret != FS_OK) return ret;
+
+  ret = reserveFile(&entry, &inode);
+  if(ret != FS_OK)
+  {
+    free(rec);
+    return ret;
+  }
+
+  if(blocksFor(size) + mapBlocksFor(blocksFor(size)) > free_block_count) ret = FS_ENOSPC;
+  if(ret == FS_OK) ret = snapshotShare(rec);
+  if(ret != FS_OK)
+  {
+    cancelFile(inode);
+    free(rec);
+    return ret;
+  }
+
+  allocFileBlocks(inode, 0, blocksFor(size));
+  if(copyFileData(&inodes[inode], 0, rec, size, 1) == -1)
+  {
+    releaseFileBlocks(&inodes[inode], blocksFor(size));
+    cancelFile(inode);
+    snapshotRefs(rec, ((struct snapHeader *)rec)->blocks, 1);
+    free(rec);
+    return FS_EIO;
+  }
+  free(rec);
+
+  commitEntry(entry, inode, SNAPSHOT_DIR, name, size);
+  directory[entry].in_use = SNAPSHOT_ENTRY;
+  markDirty(&directory[entry].in_use, sizeof(directory[entry].in_use));
+
+  setFeatures(FS_FEATURE_REFCOUNT | FS_FEATURE_SNAPSHOT);
+  return FS_OK;
+}
+
+//Number of blocks of pointers the files a record lists need
+uint32_t snapshotMapBlocks(uint8_t *rec)
+{
+  struct snapHeader *hdr = (struct snapHeader *)rec;
+  uint8_t *pos = rec + sizeof(*hdr);
+  uint32_t i, j, count, blocks = 0;
+
+  for(i = 0; i < hdr->files; i++)
+  {
+    struct snapFile *file = (struct snapFile *)pos;
+    struct extent *ext = (struct extent *)(file + 1);
+    pos += sizeof(*file) + file->extents * sizeof(struct extent);
+
+    for(j = 0, count = 0; j < file->extents; j++)
+      count += ext[j].length;
+    blocks += mapBlocksFor(count);
+  }
+  return blocks;
+}
+
+//Put the files back as the snapshot in directory entry snap recorded them, in place of the ones
+//there are now, deleted ones included. Caller holds meta_lock exclusive
+//Returns FS_OK, FS_ENFILE, FS_ENOSPC, FS_ENOMEM, FS_EIO, FS_EBADIMG or BLOCK_REFS_FULL
+int rollbackSnapshot(int32_t snap)
+{
+  uint8_t *rec;
+  uint32_t i, j, k, snapshots = 0, freed = 0, *dirs;
+  int ret = snapshotLoad(snap, &rec);
+  if(ret != FS_OK) return ret;
+
+  //Only the snapshots keep their entries and inodes
+  struct snapHeader *hdr = (struct snapHeader *)rec;
+  for(i = 0; i < NUM_FILES; i++)
+    if(directory[i].in_use == SNAPSHOT_ENTRY) snapshots++;
+  if(hdr->files > sb.max_files - snapshots) ret = FS_ENFILE;
+
+  //The directory put back last at each depth, which the files after it at one deeper go in
+  dirs = malloc((hdr->files + 1) * sizeof(uint32_t));
+  if(dirs == NULL) ret = FS_ENOMEM;
+  else dirs[0] = ROOT_DIR;
+
+  //The recorded blocks gain their references before the files there are now let go of theirs,
+  //so none of them is freed on the way
+  if(ret == FS_OK) ret = snapshotShare(rec);
+  if(ret != FS_OK)
+  {
+    free(dirs);
+    free(rec);
+    return ret;
+  }
+
+  //The files put back need blocks of pointers of their own, out of at least what the files
+  //there now free
+  for(i = 0; i < NUM_FILES; i++)
+  {
+    if(directory[i].in_use != 1) continue;
+
+    struct inode *thisInode = &inodes[directory[i].inode];
+    uint32_t count = storedBlocks(thisInode);
+    freed += unsharedBlocks(thisInode, count) + mapBlocksFor(count);
+  }
+  if(snapshotMapBlocks(rec) > free_block_count + freed)
+  {
+    snapshotRefs(rec, hdr->blocks, 1);
+    free(dirs);
+    free(rec);
+    return FS_ENOSPC;
+  }
+
+  for(i = 0; i < NUM_FILES; i++)
+    if(directory[i].in_use != SNAPSHOT_ENTRY) dropEntry(i);
+  cwd = ROOT_DIR;
+
+  uint8_t *pos = rec + sizeof(*hdr);
+  for(i = 0; i < hdr->files; i++)
+  {
+    struct snapFile *file = (struct snapFile *)pos;
+    struct extent *ext = (struct extent *)(file + 1);
+    pos += sizeof(*file) + file->extents * sizeof(struct extent);
+
+    //There is room for every file, checked above
+    int32_t entry, inode;
+    uint32_t count = 0;
+    reserveFile(&entry, &inode);
+
+    for(j = 0; j < file->extents; j++)
+      for(k = 0; k < ext[j].length; k++)
+        setFileBlock(&inodes[inode], count++, ext[j].start + k);
+
+    commitEntry(entry, inode, dirs[file->depth], file->filename, file->file_size);
+    inodes[inode].attribute = file->attribute;
+    storeInode(&inodes[inode]);
+    if((file->attribute >> DIRECTORY_ATTR) & 1) dirs[file->depth + 1] = entry + 1;
+  }
+
+  free(dirs);
+  free(rec);
+  return FS_OK;
+}
+
+//Remove the snapshot in directory entry snap and the references it holds. A record that doesn't
+//add up is removed without them, leaving its blocks in use. Caller holds meta_lock exclusive
+//Returns FS_OK, FS_EBADIMG once removed that way, or FS_ENOMEM or FS_EIO leaving it in place
+int dropSnapshot(int32_t snap)
+{
+  uint8_t *rec;
+  int ret = snapshotLoad(snap, &rec);
+  if(ret == FS_ENOMEM || ret == FS_EIO) return ret;
+
+  if(ret == FS_OK)
+  {
+    snapshotRefs(rec, ((struct snapHeader *)rec)->blocks, 1);
+    free(rec);
+  }
+
+  dropEntry(snap);
+  return ret;
+}
+
+//Make newname a file sharing every block of the file in directory entry src
+//Caller holds meta_lock exclusive. Returns FS_OK, FS_EEXIST, FS_ENOENT or FS_EINVAL for a name
+//that can't be used, FS_ENFILE, FS_ENOSPC or BLOCK_REFS_FULL
+int shareFile(int32_t src, char *newname)
+{
+  int32_t entry, inode;
+  int ret = checkNewName(newname);
+  if(ret != FS_OK) return ret;
+
+  ret = reserveFile(&entry, &inode);
+  if(ret != FS_OK) return ret;
+
+  struct inode *from = &inodes[directory[src].inode], *to = &inodes[inode];
+  uint32_t i, count = storedBlocks(from);
+
+  //Only the blocks of pointers aren't shared
+  if(mapBlocksFor(count) > free_block_count)
+  {
+    cancelFile(inode);
+    return FS_ENOSPC;
+  }
+
+  for(i = 0; i < count && blockRefs(fileBlock(from, i)) < 255; i++)
+    setBlockRefs(fileBlock(from, i), blockRefs(fileBlock(from, i)) + 1);
+  if(i < count)
+  {
+    while(i-- > 0)
+      releaseBlock(fileBlock(from, i));
+    cancelFile(inode);
+    return BLOCK_REFS_FULL;
+  }
+
+  for(i = 0; i < count; i++)
+    setFileBlock(to, i, fileBlock(from, i));
+  commitFile(entry, inode, newname, from->file_size);
+  to->attribute = from->attribute;
+  storeInode(to);
+
+  setFeatures(FS_FEATURE_REFCOUNT);
+  return FS_OK;
+}
+
+//Snapshots and clones are kept in the superblock's feature bits, which images from before it lack
+uint8_t canShare()
+{
+  if(sb.magic == FS_MAGIC) return 1;
+  fsError("Image %s predates snapshots, copy its files to a new image to use them\n", image_name);
+  return 0;
+}
+
+//Take a snapshot of the files in the open image
+void snapshot(char *name)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  if(!image_open) fsError("No image open\n");
+  else if(canShare())
+  {
+    int ret = takeSnapshot(name);
+    if(ret == FS_EEXIST) fsError("Snapshot %s already exists\n", name);
+    else if(ret == FS_EINVAL) fsError("%s can't be used as a snapshot name, names are 1 to 63 characters without /\n", name);
+    else if(ret == FS_EFBIG) fsError("Image %s has too many files or extents to record in a snapshot\n", image_name);
+    else if(ret == FS_ENOSPC) fsError("Not enough free space to record snapshot %s\n", name);
+    else if(ret == FS_ENFILE) fsError("No free directory entry for snapshot %s\n", name);
+    else if(ret == FS_ENOMEM) fsError("Not enough memory to record snapshot %s\n", name);
+    else if(ret == FS_EIO) fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+    else if(ret == BLOCK_REFS_FULL) fsError("Blocks of %s are shared too many times for another snapshot\n", image_name);
+  }
+
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//List the snapshots of the open image, with when they were taken and how many files they hold
+void listSnapshots()
+{
+  uint32_t i, found = 0;
+  struct snapHeader hdr;
+  char when[32];
+
+  pthread_rwlock_rdlock(&meta_lock);
+
+  if(!image_open)
+  {
+    pthread_rwlock_unlock(&meta_lock);
+    fsError("No image open\n");
+    return;
+  }
+
+  flockfile(stdout);
+  for(i = 0; i < NUM_FILES; i++)
+  {
+    if(directory[i].in_use != SNAPSHOT_ENTRY) continue;
+
+    struct inode *thisInode = &inodes[directory[i].inode];
+    if(thisInode->file_size < sizeof(hdr) || copyFileData(thisInode, 0, (uint8_t *)&hdr, sizeof(hdr), 0) == -1 ||
+       hdr.magic != SNAP_MAGIC)
+    {
+      printf("%s\tdamaged\n", directory[i].filename);
+      found = 1;
+      continue;
+    }
+
+    time_t taken = hdr.taken;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&taken));
+    printf("%s\t%s\t%u files\n", directory[i].filename, when, hdr.files);
+    found = 1;
+  }
+  funlockfile(stdout);
+
+  pthread_rwlock_unlock(&meta_lock);
+
+  if(!found) fsInfo("No snapshots found\n");
+}
+
+//Delete a snapshot, freeing the blocks only it still holds
+void deleteSnapshot(char *name)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  int32_t snap = image_open ? findEntry(name, SNAPSHOT_ENTRY) : -1;
+  if(!image_open) fsError("No image open\n");
+  else if(snap == -1) fsError("Snapshot %s doesn't exist\n", name);
+  else
+  {
+    int ret = dropSnapshot(snap);
+    if(ret == FS_EBADIMG) fsError("Snapshot %s is damaged, deleted it but the blocks it held stay in use\n", name);
+    else if(ret == FS_ENOMEM) fsError("Not enough memory to read snapshot %s\n", name);
+    else if(ret == FS_EIO) fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+  }
+
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//Put the files of the open image back as a snapshot recorded them. The snapshot is kept
+void rollback(char *name)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  int32_t snap = image_open ? findEntry(name, SNAPSHOT_ENTRY) : -1;
+  if(!image_open) fsError("No image open\n");
+  else if(snap == -1) fsError("Snapshot %s doesn't exist\n", name);
+  else
+  {
+    int ret = rollbackSnapshot(snap);
+    if(ret == FS_ENFILE) fsError("Not enough free directory entries to roll back to %s\n", name);
+    else if(ret == FS_ENOSPC) fsError("Not enough free space to roll back to %s\n", name);
+    else if(ret == FS_EBADIMG) fsError("Snapshot %s is damaged, can't roll back to it\n", name);
+    else if(ret == FS_ENOMEM) fsError("Not enough memory to read snapshot %s\n", name);
+    else if(ret == FS_EIO) fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+    else if(ret == BLOCK_REFS_FULL) fsError("Blocks of %s are shared too many times to roll back to %s\n", image_name, name);
+  }
+
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//Copy a file under a new name, sharing its blocks until either copy is changed
+void cloneFile(char *filename, char *newFilename)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  int32_t src = image_open ? fileExists(filename) : -1;
+  if(!image_open) fsError("No image open\n");
+  else if(src == -1) fsError("File %s doesn't exist\n", filename);
+  else if(isDirectory(src)) fsError("%s is a directory\n", filename);
+  else if(canShare())
+  {
+    int ret = shareFile(src, newFilename);
+    if(ret == FS_EEXIST) fsError("File %s already exists\n", newFilename);
+    else if(ret == FS_ENOENT) fsError("Directory of %s doesn't exist\n", newFilename);
+    else if(ret == FS_EINVAL) fsError("%s can't be used as a filename\n", newFilename);
+    else if(ret == FS_ENFILE) fsError("No free directory entry for %s\n", newFilename);
+    else if(ret == FS_ENOSPC) fsError("Not enough free space to clone %s\n", filename);
+    else if(ret == BLOCK_REFS_FULL) fsError("Blocks of %s are shared too many times to clone it\n", filename);
+  }
+
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//Directories are kept in the superblock's feature bits, so images without one are flat
+uint8_t hasDirs()
+{
+  if(treeDirs()) return 1;
+  fsError("Image %s has no directories, copy its files to a new image to use them\n", image_name);
+  return 0;
+}
+
+//Make a directory in the open image
+void makeDirectory(char *path)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  if(!image_open) fsError("No image open\n");
+  else if(hasDirs())
+  {
+    int ret = createDirectory(path);
+    if(ret == FS_EEXIST) fsError("%s already exists\n", path);
+    else if(ret == FS_ENOENT) fsError("Directory of %s doesn't exist\n", path);
+    else if(ret == FS_EINVAL) fsError("%s can't be used as a directory name\n", path);
+    else if(ret == FS_ENFILE) fsError("No free directory entry for %s\n", path);
+  }
+
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//Make path the directory relative paths start from
+void changeDirectory(char *path)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  if(!image_open) fsError("No image open\n");
+  else if(hasDirs())
+  {
+    uint32_t dir = walkPath(path, NULL);
+    if(dir == NO_DIR) fsError("Directory %s doesn't exist\n", path);
+    else cwd = dir;
+  }
+
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//Print the path of the current directory
+void printDirectory()
+{
+  pthread_rwlock_rdlock(&meta_lock);
+
+  if(!image_open) fsError("No image open\n");
+  else if(hasDirs())
+  {
+    //Gather the way up to the root, then print it down from there
+    uint32_t dir, depth = 0;
+    int32_t *path = malloc(NUM_FILES * sizeof(int32_t));
+    if(path == NULL) fsError("Not enough memory\n");
+    else
+    {
+      for(dir = cwd; dir != ROOT_DIR; dir = parents[dir - 1])
+        path[depth++] = dir - 1;
+
+      flockfile(stdout);
+      if(depth == 0) printf("/");
+      while(depth > 0)
+        printf("/%s", directory[path[--depth]].filename);
+      printf("\n");
+      funlockfile(stdout);
+      free(path);
+    }
+  }
+
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//----------Defragmentation----------
+//defrag moves each file whose blocks are split over several extents into the first free run
+//that holds all of them, so files become contiguous in file order and gather towards the start
+//of the image as they move. Blocks shared with other files or snapshots stay where they are,
+//since every owner would have to follow them.
+struct fragStats {
+  uint32_t files;    //Files and snapshots holding blocks
+  uint32_t extents;
+  uint32_t blocks;
+};
+
+//Blocks held by the file or snapshot in directory entry entry
+uint32_t entryBlocks(int32_t entry)
+{
+  struct inode *thisInode = &inodes[directory[entry].inode];
+  return directory[entry].in_use == SNAPSHOT_ENTRY ? blocksFor(thisInode->file_size) : storedBlocks(thisInode);
+}
+
+void fragCount(struct fragStats *st)
+{
+  uint32_t i, count;
+  memset(st, 0, sizeof(*st));
+
+  for(i = 0; i < NUM_FILES; i++)
+  {
+    if(!directory[i].in_use || (count = entryBlocks(i)) == 0) continue;
+
+    st->files++;
+    st->blocks += count;
+    st->extents += extentCount(&inodes[directory[i].inode], count);
+  }
+}
+
+//Percentage of steps from one block of a file to the next that leave the run it is in
+static inline double fragScore(struct fragStats *st)
+{
+  return st->blocks > st->files ? 100.0 * (st->extents - st->files) / (st->blocks - st->files) : 0;
+}
+
+//Copy the count blocks of the file or snapshot in directory entry entry into the free run at
+//start, then let go of the old ones. Caller holds meta_lock exclusive and has checked the run
+//is free. Returns FS_OK, or FS_EIO if blocks of a pooled image couldn't be read, moving nothing
+int moveBlocks(int32_t entry, uint32_t count, uint32_t start)
+{
+  struct inode *thisInode = &inodes[directory[entry].inode];
+  struct extent ext;
+  uint32_t i;
+
+  for(i = 0; i < count; i++)
+    claimBlock(start + i);
+
+  for(i = 0; i < count; i += ext.length)
+  {
+    nextExtent(thisInode, i, count - i, &ext);
+
+    uint8_t *src = pinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length, 0);
+    uint8_t *dst = src ? pinBlocks(FIRST_DATA_BLOCK + start + i, ext.length, 1) : NULL;
+    if(dst == NULL)
+    {
+      if(src != NULL) unpinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length);
+      for(i = 0; i < count; i++)
+      {
+        releaseBlock(start + i);
+        markClean(FIRST_DATA_BLOCK + start + i);
+      }
+      return FS_EIO;
+    }
+
+    memcpy(dst, src, (size_t)ext.length * BLOCK_SIZE);
+    markDirty(dst, ext.length * BLOCK_SIZE);
+    unpinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length);
+    unpinBlocks(FIRST_DATA_BLOCK + start + i, ext.length);
+  }
+
+  //The old blocks are free again and their contents never need saving
+  for(i = 0; i < count; i++)
+  {
+    releaseBlock(fileBlock(thisInode, i));
+    markClean(FIRST_DATA_BLOCK + fileBlock(thisInode, i));
+    setFileBlock(thisInode, i, start + i);
+  }
+  return FS_OK;
+}
+
+//Bounds on one defrag run, and what it did
+struct defragRun {
+  uint64_t byte_budget;  //0 for no limit
+  double   seconds;      //0 for no limit
+  uint32_t moved;
+  uint64_t bytes;
+  uint32_t stuck;        //Fragmented files that share blocks or have no free run to go to
+  uint32_t need;         //Blocks of the smallest stuck file that only lacks a free run, 0 for none
+  uint8_t  stopped;      //Whether a budget ran out
+  struct timespec begin;
+};
+
+//Move the file or snapshot in directory entry entry to the free run at start, unless that takes
+//the run past either budget, which stops it. Returns FS_OK or FS_EIO
+int defragMove(struct defragRun *run, int32_t entry, uint32_t count, uint32_t start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = now.tv_sec - run->begin.tv_sec + (now.tv_nsec - run->begin.tv_nsec) / 1e9;
+
+  if((run->byte_budget && run->bytes + (uint64_t)count * BLOCK_SIZE > run->byte_budget) ||
+     (run->seconds > 0 && elapsed >= run->seconds))
+  {
+    run->stopped = 1;
+    return FS_OK;
+  }
+
+  if(moveBlocks(entry, count, start) != FS_OK) return FS_EIO;
+  run->moved++;
+  run->bytes += (uint64_t)count * BLOCK_SIZE;
+  return FS_OK;
+}
+
+//Orders directory entries by the first block they hold
+int compareFirstBlock(const void *a, const void *b)
+{
+  int32_t x = fileBlock(&inodes[directory[*(const int32_t *)a].inode], 0);
+  int32_t y = fileBlock(&inodes[directory[*(const int32_t *)b].inode], 0);
+  return (x > y) - (x < y);
+}
+
+//Whether the blocks a file lets go of, once its count blocks are at start, lie next to free
+//space, so moving it joins free runs rather than only trading one hole for another
+uint8_t vacateJoins(struct inode *thisInode, uint32_t count, uint32_t start)
+{
+  uint32_t i, before, after;
+  struct extent ext;
+
+  for(i = 0; i < count; i += ext.length)
+  {
+    nextExtent(thisInode, i, count - i, &ext);
+    before = ext.start - 1;
+    after = ext.start + ext.length;
+    if(isBlockFree(before) && (before < start || before >= start + count)) return 1;
+    if(isBlockFree(after) && (after < start || after >= start + count)) return 1;
+  }
+  return 0;
+}
+
+//Slide files down into the first free run below them that holds them whole, lowest first, so
+//the free space left between files gathers above them. Only moves that join free runs are
+//made, and it stops once the smallest stuck file fits. Returns FS_OK or FS_EIO
+int defragCompact(struct defragRun *run, int32_t *order)
+{
+  uint32_t i, n = 0, count, start;
+
+  for(i = 0; i < NUM_FILES; i++)
+    if(directory[i].in_use && entryBlocks(i) > 0) order[n++] = i;
+  qsort(order, n, sizeof(int32_t), compareFirstBlock);
+
+  for(i = 0; i < n && !run->stopped; i++)
+  {
+    if(findFreeRun(run->need, &start) >= run->need) break;
+
+    struct inode *thisInode = &inodes[directory[order[i]].inode];
+    count = entryBlocks(order[i]);
+    if(unsharedBlocks(thisInode, count) < count || findFreeRun(count, &start) < count) continue;
+    if(start > (uint32_t)fileBlock(thisInode, 0) || !vacateJoins(thisInode, count, start)) continue;
+
+    if(defragMove(run, order[i], count, start) != FS_OK) return FS_EIO;
+  }
+  return FS_OK;
+}
+
+//Move each fragmented file into the first free run that holds it whole. Files that find none
+//get another try once compacting the others has gathered the free space, and passes repeat
+//while they make progress, until a budget runs out. Caller holds meta_lock exclusive
+//Returns FS_OK, FS_ENOMEM, or FS_EIO with the files moved so far left in place
+int defragFiles(struct defragRun *run)
+{
+  uint32_t i, count, start, moved;
+  int ret = FS_OK;
+
+  int32_t *order = malloc(NUM_FILES * sizeof(int32_t));
+  if(order == NULL) return FS_ENOMEM;
+
+  clock_gettime(CLOCK_MONOTONIC, &run->begin);
+  run->moved = 0;
+  run->bytes = 0;
+  run->stopped = 0;
+
+  do
+  {
+    moved = run->moved;
+    run->stuck = 0;
+    run->need = 0;
+
+    for(i = 0; i < NUM_FILES && !run->stopped && ret == FS_OK; i++)
+    {
+      if(!directory[i].in_use || (count = entryBlocks(i)) == 0) continue;
+
+      struct inode *thisInode = &inodes[directory[i].inode];
+      if(extentCount(thisInode, count) == 1) continue;
+      if(unsharedBlocks(thisInode, count) < count) run->stuck++;
+      else if(findFreeRun(count, &start) < count)
+      {
+        run->stuck++;
+        if(run->need == 0 || count < run->need) run->need = count;
+      }
+      else ret = defragMove(run, i, count, start);
+    }
+
+    //Compacting can't free files held by shared blocks, or make a run longer than the free space
+    if(ret == FS_OK && run->need && free_block_count >= run->need && !run->stopped) ret = defragCompact(run, order);
+  } while(ret == FS_OK && !run->stopped && run->stuck && run->moved > moved);
+
+  //Fingerprints of the moved blocks point where they were
+  if(run->moved && (sb.features & FS_FEATURE_DEDUP)) buildFingerprints();
+  free(order);
+  return ret;
+}
+
+//Make the files of the open image contiguous, printing the fragmentation before and after
+//seconds and megabytes bound the work done by one run, 0 for no bound
+void defrag(uint32_t seconds, uint32_t megabytes)
+{
+  struct fragStats before, after;
+  struct defragRun run;
+  memset(&run, 0, sizeof(run));
+  run.byte_budget = (uint64_t)megabytes << 20;
+  run.seconds = seconds;
+
+  pthread_rwlock_wrlock(&meta_lock);
+
+  if(!image_open)
+  {
+    fsError("No image open\n");
+    goto out;
+  }
+
+  fragCount(&before);
+  printf("Fragmentation of %s: %.1f%%, %u extents in %u files\n", image_name, fragScore(&before),
+         before.extents, before.files);
+
+  int ret = defragFiles(&run);
+  if(ret == FS_ENOMEM) fsError("Not enough memory to defrag %s\n", image_name);
+  else if(ret == FS_EIO) fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+
+  fragCount(&after);
+  printf("Moved %u files, %" PRIu64 " bytes\n", run.moved, run.bytes);
+  printf("Fragmentation of %s: %.1f%%, %u extents in %u files\n", image_name, fragScore(&after),
+         after.extents, after.files);
+
+  if(run.stopped) fsInfo("Stopped at the budget, run defrag again to continue\n");
+  else if(run.stuck) fsInfo("%u files share blocks or don't fit in the free space whole, left as they are\n", run.stuck);
+
+out:
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//----------Checksums----------
+//Images with FS_FEATURE_CRC keep a CRC32C of every block from the directory on in a table
+//between the inodes and the data blocks, and the superblock holds one of the table itself.
+//saveImage brings the checksums of changed blocks up to date, so a block changed since the last
+//save has none yet and is taken on trust. Reads check the blocks they touch, scrub all of them.
+
+//Whether the table holds a checksum for block b: every block from the directory on but the
+//table's own, which the superblock covers. Free data blocks hold nothing worth checking.
+static inline uint8_t crcCovers(uint32_t b)
+{
+  if(b < sb.directory_block || (b >= sb.crc_block && b < FIRST_DATA_BLOCK)) return 0;
+  return b < FIRST_DATA_BLOCK || !isBlockFree(b - FIRST_DATA_BLOCK);
+}
+
+//Checksum of the checksum table
+uint32_t tableCrc()
+{
+  return crc32c(blockData(sb.crc_block), (size_t)(FIRST_DATA_BLOCK - sb.crc_block) * BLOCK_SIZE);
+}
+
+//Checksum every table block of a newly formatted image, most of which are never written
+void formatChecksums()
+{
+  uint32_t b;
+  if(!(sb.features & FS_FEATURE_CRC)) return;
+
+  for(b = sb.directory_block; b < sb.crc_block; b++)
+    block_crcs[b] = blockCrc(b);
+  markDirty(block_crcs, (FIRST_DATA_BLOCK - sb.crc_block) * BLOCK_SIZE);
+}
+
+//Bring the checksums of the blocks changed since the last save up to date, and the
+//superblock's checksum of the table with them. Runs before the dirty blocks are written.
+void updateChecksums()
+{
+  uint32_t b;
+  uint8_t changed = 0;
+  if(!(sb.features & FS_FEATURE_CRC)) return;
+
+  for(b = nextDirty(0, 1); b < NUM_BLOCKS; b = nextDirty(b + 1, 1))
+  {
+    if(b >= sb.crc_block && b < FIRST_DATA_BLOCK) changed = 1;
+    if(!crcCovers(b)) continue;
+
+    block_crcs[b] = blockCrc(b);
+    markDirty(&block_crcs[b], sizeof(uint32_t));
+    changed = 1;
+  }
+  if(!changed) return;
+
+  sb.table_crc = tableCrc();
+  memcpy(data, &sb, sizeof(sb));
+  markDirty(data, sizeof(sb));
+}
+
+//Check the table blocks of a newly opened image. Returns FS_OK, or FS_ECORRUPT if the
+//checksum table or a table block it covers doesn't match, or the directory index doesn't add up
+int verifyTables()
+{
+  uint32_t b;
+  if(checkDirIndex() != FS_OK) return FS_ECORRUPT;
+  if(!(sb.features & FS_FEATURE_CRC)) return FS_OK;
+
+  //An image that open -m didn't close has checksums behind its blocks, see recoverChecksums
+  if(sb.open_mapped) return FS_OK;
+
+  if(tableCrc() != sb.table_crc) return FS_ECORRUPT;
+  for(b = sb.directory_block; b < sb.crc_block; b++)
+    if(!blockDirty(b) && block_crcs[b] != blockCrc(b)) return FS_ECORRUPT;
+  return FS_OK;
+}
+
+//Record in the superblock whether open -m has the image. Mapped images write their blocks
+//through to the file straight away but their checksums only on save and close, so an image
+//still marked on open was left some other way
+void markMapped(uint8_t mapped)
+{
+  sb.open_mapped = mapped;
+  memcpy(data, &sb, sizeof(sb));
+  markDirty(data, sizeof(sb));
+}
+
+//Recompute every checksum of an image open -m left without closing, from what the file holds
+//Runs once the tables are loaded, so only blocks in use are checksummed
+void recoverChecksums()
+{
+  uint32_t b;
+  if(!sb.open_mapped) return;
+
+  if(sb.features & FS_FEATURE_CRC)
+  {
+    for(b = sb.directory_block; b < NUM_BLOCKS; b++)
+    {
+      if(!crcCovers(b) || pinBlocks(b, 1, 0) == NULL) continue;
+      block_crcs[b] = blockCrc(b);
+      unpinBlocks(b, 1);
+    }
+    markDirty(block_crcs, (FIRST_DATA_BLOCK - sb.crc_block) * BLOCK_SIZE);
+    sb.table_crc = tableCrc();
+  }
+  markMapped(0);
+}
+
+//Check the blocks holding bytes [offset, offset+len) of what the inode stores
+//Returns -1 if they all match, otherwise the first image block that doesn't
+int32_t verifyStored(struct inode *thisInode, uint32_t offset, uint32_t len)
+{
+  uint32_t i, j, b, end;
+  struct extent ext;
+  if(len == 0) return -1;
+
+  //Blocks that can't be read at all are left for the read itself to report
+  end = (offset + len - 1) / BLOCK_SIZE + 1;
+  for(i = offset / BLOCK_SIZE; i < end; i += ext.length)
+  {
+    nextExtent(thisInode, i, end - i, &ext);
+    b = FIRST_DATA_BLOCK + ext.start;
+    if(pinBlocks(b, ext.length, 0) == NULL) continue;
+
+    for(j = 0; j < ext.length; j++)
+      if(!blockDirty(b + j) && block_crcs[b + j] != blockCrc(b + j)) break;
+    unpinBlocks(b, ext.length);
+    if(j < ext.length) return b + j;
+  }
+  return -1;
+}
+
+//Check the blocks a read of bytes [offset, offset+len) of a file depends on. For a compressed
+//file that is its header, the chunk table and the packed chunks the range falls in.
+//Returns -1 if they all match, or have no checksum yet, otherwise the first image block that doesn't
+int32_t verifyBlocks(struct inode *thisInode, uint32_t offset, uint32_t len)
+{
+  if(!(sb.features & FS_FEATURE_CRC) || len == 0) return -1;
+  if(!(thisInode->attribute & (1 << COMPRESSED_ATTR))) return verifyStored(thisInode, offset, len);
+
+  struct packHeader hdr;
+  int32_t bad = verifyStored(thisInode, 0, sizeof(hdr));
+  if(bad != -1) return bad;
+
+  //A header that doesn't add up is for the decompressor to report
+  if(packHeaderRead(thisInode, &hdr) == -1) return -1;
+
+  uint32_t table = sizeof(hdr), base = table + hdr.chunks * sizeof(uint32_t), bounds[2];
+  bad = verifyStored(thisInode, table, base - table);
+  if(bad != -1) return bad;
+
+  uint32_t first = offset / PACK_CHUNK, last = (offset + len - 1) / PACK_CHUNK;
+  bounds[0] = 0;
+  if(first > 0 && copyFileData(thisInode, table + (first - 1) * sizeof(uint32_t), (uint8_t *)&bounds[0], sizeof(uint32_t), 0) == -1) return -1;
+  if(copyFileData(thisInode, table + last * sizeof(uint32_t), (uint8_t *)&bounds[1], sizeof(uint32_t), 0) == -1) return -1;
+  if(bounds[0] > bounds[1] || bounds[1] > hdr.stored_size - base) return -1;
+
+  return verifyStored(thisInode, base + bounds[0], bounds[1] - bounds[0]);
+}
+
+//Scrub workers check runs of this many blocks at a time
+#define SCRUB_RUN 1024
+
+struct scrubPool {
+  uint32_t  next;
+  uint32_t  checked;
+  uint32_t  failed;
+  uint8_t  *bad;  //One bit per image block that failed
+};
+
+//Workers take the next unchecked run of blocks until none are left
+void *scrubWorker(void *arg)
+{
+  struct scrubPool *pool = arg;
+  uint32_t start, end, b, first, run, checked, failed;
+  uint8_t *buf;
+
+  while((start = __atomic_fetch_add(&pool->next, SCRUB_RUN, __ATOMIC_RELAXED)) < NUM_BLOCKS)
+  {
+    end = NUM_BLOCKS - start > SCRUB_RUN ? start + SCRUB_RUN : NUM_BLOCKS;
+    checked = 0;
+    failed = 0;
+
+    //Pooled images read in each run of blocks to check at once, one that can't be read fails
+    for(b = start; b < end; b = run)
+    {
+      for(run = b; run < end && crcCovers(run) && !blockDirty(run); run++);
+      if(run == b)
+      {
+        run++;
+        continue;
+      }
+
+      first = b;
+      buf = pinBlocks(first, run - first, 0);
+      for(; b < run; b++)
+      {
+        checked++;
+        if(buf != NULL && block_crcs[b] == blockCrc(b)) continue;
+
+        failed++;
+        __atomic_fetch_or(&pool->bad[b >> 3], 1 << (b & 7), __ATOMIC_RELAXED);
+      }
+      if(buf != NULL) unpinBlocks(first, run - first);
+    }
+
+    __atomic_fetch_add(&pool->checked, checked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->failed, failed, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+//Name what a block that failed its checksum belongs to
+void reportBadBlock(uint32_t b)
+{
+  uint32_t i, j;
+
+  if(b < sb.free_inodes_block) fsError("Block %u, in the directory, failed its checksum\n", b);
+  else if(b < sb.free_blocks_block) fsError("Block %u, in the free inode map, failed its checksum\n", b);
+  else if(b < sb.inodes_block) fsError("Block %u, in the free block map, failed its checksum\n", b);
+  else if(b < sb.crc_block) fsError("Block %u, in the inode table, failed its checksum\n", b);
+  if(b < FIRST_DATA_BLOCK) return;
+
+  //Shared blocks belong to every file and snapshot holding them
+  uint8_t found = 0;
+  for(i = 0; i < NUM_FILES; i++)
+  {
+    if(!directory[i].in_use) continue;
+
+    uint8_t snap = directory[i].in_use == SNAPSHOT_ENTRY;
+    struct inode *thisInode = &inodes[directory[i].inode];
+    uint32_t count = snap ? blocksFor(thisInode->file_size) : storedBlocks(thisInode);
+    for(j = 0; j < count; j++)
+      if(FIRST_DATA_BLOCK + fileBlock(thisInode, j) == b) break;
+
+    if(j < count || (snap && snapshotHolds(i, b - FIRST_DATA_BLOCK)))
+    {
+      fsError("Block %u, held by %s%s, failed its checksum\n", b, snap ? "snapshot " : "", directory[i].filename);
+      found = 1;
+    }
+  }
+  if(!found) fsError("Block %u failed its checksum\n", b);
+}
+
+//Check every block in use against its checksum with up to threads workers, 0 for one per CPU
+//Blocks changed since the last save have no checksum yet and are skipped
+void scrub(uint32_t threads)
+{
+  uint32_t i, b;
+
+  //Nothing may change the blocks or the table while they are checked
+  pthread_rwlock_wrlock(&meta_lock);
+
+  if(!image_open)
+  {
+    fsError("No image open\n");
+    goto out;
+  }
+
+  if(!(sb.features & FS_FEATURE_CRC))
+  {
+    fsError("Image %s has no checksums, copy its files to a new image to use scrub\n", image_name);
+    goto out;
+  }
+
+  struct scrubPool pool = { 0, 0, 0, calloc(blockMapSize(), 1) };
+  if(pool.bad == NULL)
+  {
+    fsError("Not enough memory to scrub %s\n", image_name);
+    goto out;
+  }
+
+  if(threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads > MAX_SCRUB_THREADS) threads = MAX_SCRUB_THREADS;
+
+  pthread_t workers[MAX_SCRUB_THREADS];
+  uint32_t started;
+
+  //Run on this thread as well, so a failed thread start only costs parallelism
+  for(started = 0; started + 1 < threads; started++)
+    if(pthread_create(&workers[started], NULL, scrubWorker, &pool) != 0) break;
+  scrubWorker(&pool);
+  for(i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  uint8_t table_bad = 0;
+  for(b = sb.crc_block; b < FIRST_DATA_BLOCK && !blockDirty(b); b++);
+  if(b == FIRST_DATA_BLOCK && tableCrc() != sb.table_crc)
+  {
+    fsError("The checksum table of %s is damaged\n", image_name);
+    table_bad = 1;
+  }
+
+  for(b = nextMapBit(pool.bad, 0, 1); b < NUM_BLOCKS; b = nextMapBit(pool.bad, b + 1, 1))
+    reportBadBlock(b);
+  free(pool.bad);
+
+  fsInfo("Scrubbed %u blocks of %s, %u failed their checksums%s\n", pool.checked, image_name,
+         pool.failed, table_bad ? " and the checksum table is damaged" : "");
+
+out:
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//----------Command functions----------
+
+void deleteFile(char *filename)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  int32_t ret = fileExists(filename);
+  if(ret == -1)
+  {
+    fsError("File %s doesn't exist\n", filename);
+    goto out;
+  }
+
+  //A directory goes once it holds no files, and the deleted files in it with it
+  if(isDirectory(ret))
+  {
+    uint32_t dir = ret + 1, block, pos;
+    struct dirRecord *rec;
+    if(dir == cwd)
+    {
+      fsError("Directory %s is the current directory\n", filename);
+      goto out;
+    }
+
+    indexSeek(dir, "", &block, &pos);
+    for(; (rec = indexAt(&block, &pos)) != NULL && rec->parent == dir; pos++)
+    {
+      if(directory[rec->entry].in_use == 1)
+      {
+        fsError("Directory %s is not empty\n", filename);
+        goto out;
+      }
+    }
+
+    indexSeek(dir, "", &block, &pos);
+    while((rec = indexAt(&block, &pos)) != NULL && rec->parent == dir)
+    {
+      dropEntry(rec->entry);
+      indexSeek(dir, "", &block, &pos);
+    }
+    dropEntry(ret);
+    goto out;
+  }
+  
+  struct directoryEntry thisDir = directory[ret];
+  
+  //Set directory entry to not in use
+  thisDir.in_use = 0;
+
+  struct inode thisInode = inodes[thisDir.inode];
+
+  //Set it's inode to not in use
+  thisInode.in_use = 0;
+
+  //Set the inode as free
+  free_inodes[thisDir.inode] = 1;
+  markDirty(&free_inodes[thisDir.inode], 1);
+
+  //Includes the partially filled end block, and is the packed size for compressed files
+  uint32_t block_count = storedBlocks(&thisInode);
+
+  //Set the inode blocks as free, the inode still points at them for undelete
+  releaseFileBlocks(&thisInode, block_count);
+  
+  //Save changes
+  inodes[thisDir.inode].in_use = thisInode.in_use;
+  storeInode(&inodes[thisDir.inode]);
+  directory[ret] = thisDir;
+  markDirty(&directory[ret], sizeof(thisDir));
+
+out:
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//If a file's inode, or any of it's blocks are not free undelete fails.
+void undeleteFile(char *filename)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  int32_t ret = findDeletedFile(filename);
+  if(ret == -1)
+  {
+    fsError("No such deleted file %s to recover\n", filename);
+    goto out;
+  }
+  if(fileExists(filename) != -1)
+  {
+    fsError("File %s already exists, cannot undelete\n", filename);
+    goto out;
+  }
+
+  struct directoryEntry thisDir = directory[ret];
+  struct inode thisInode = inodes[thisDir.inode];
+
+  if(thisInode.in_use || !(free_inodes[thisDir.inode]))
+  {
+    fsError("File %s inode overwritten, cannot undelete\n", filename);
+    goto out;
+  }
+
+  uint32_t block_count = storedBlocks(&thisInode);
+
+  //The file's blocks are found through its blocks of pointers, which have to be intact first
+  if(mapFile(&thisInode, block_count, MAP_CHECK) == -1)
+  {
+    fsError("File %s block overwritten, cannot undelete\n", filename);
+    goto out;
+  }
+  if(mapFile(&thisInode, block_count, MAP_CLAIM) == -1)
+  {
+    fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+    goto out;
+  }
+
+  uint32_t i;
+  for(i = 0; i < block_count; i++)
+  {
+    if(!isBlockFree(fileBlock(&thisInode, i)))
+    {
+      mapFile(&thisInode, block_count, MAP_RELEASE);
+      fsError("File %s block overwritten, cannot undelete\n", filename);
+      goto out;
+    }
+  }
+
+  for(i = 0; i < block_count; i++)
+    claimBlock(fileBlock(&thisInode, i));
+  
+  thisInode.in_use = 1;
+  thisDir.in_use = 1;
+
+  inodes[thisDir.inode].in_use = thisInode.in_use;
+  storeInode(&inodes[thisDir.inode]);
+  directory[ret] = thisDir;
+  markDirty(&directory[ret], sizeof(thisDir));
+
+out:
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//----------XOR cipher kernels----------
+//Each XORs len bytes of buf with pattern starting at pos. pattern holds the key repeated over
+//period bytes plus 32 more, and period is a multiple of 32 so a vector load never wraps.
+void xorScalar(uint8_t *buf, size_t len, const uint8_t *pattern, uint32_t period, uint32_t pos)
+{
+  uint64_t word, key;
+  while(len >= 8)
+  {
+    memcpy(&word, buf, 8);
+    memcpy(&key, pattern + pos, 8);
+    word ^= key;
+    memcpy(buf, &word, 8);
+
+    buf += 8;
+    len -= 8;
+    pos += 8;
+    if(pos >= period) pos -= period;
+  }
+  while(len--)
+    *buf++ ^= pattern[pos++];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void xorSSE2(uint8_t *buf, size_t len, const uint8_t *pattern, uint32_t period, uint32_t pos)
+{
+  while(len >= 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)buf);
+    __m128i k = _mm_loadu_si128((const __m128i *)(pattern + pos));
+    _mm_storeu_si128((__m128i *)buf, _mm_xor_si128(v, k));
+
+    buf += 16;
+    len -= 16;
+    pos += 16;
+    if(pos >= period) pos -= period;
+  }
+  while(len--)
+    *buf++ ^= pattern[pos++];
+}
+
+__attribute__((target("avx2")))
+void xorAVX2(uint8_t *buf, size_t len, const uint8_t *pattern, uint32_t period, uint32_t pos)
+{
+  while(len >= 32)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i *)buf);
+    __m256i k = _mm256_loadu_si256((const __m256i *)(pattern + pos));
+    _mm256_storeu_si256((__m256i *)buf, _mm256_xor_si256(v, k));
+
+    buf += 32;
+    len -= 32;
+    pos += 32;
+    if(pos >= period) pos -= period;
+  }
+  while(len--)
+    *buf++ ^= pattern[pos++];
+}
+#endif
+
+void (*xorKernel)(uint8_t *, size_t, const uint8_t *, uint32_t, uint32_t) = xorScalar;
+
+//Pick the widest XOR kernel the CPU supports
+void selectXorKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) xorKernel = xorAVX2;
+  else if(__builtin_cpu_supports("sse2")) xorKernel = xorSSE2;
+#endif
+}
+
+//XOR encrypt specified file with the key repeated over its whole length
+void encryptFile(char *filename, uint8_t *key, uint32_t key_len)
+{
+  pthread_rwlock_rdlock(&meta_lock);
+
+  int32_t ret = fileExists(filename);
+  if(ret == -1 || isDirectory(ret))
+  {
+    if(ret == -1) fsError("File %s doesn't exist\n", filename);
+    else fsError("%s is a directory\n", filename);
+    pthread_rwlock_unlock(&meta_lock);
+    return;
+  }
+
+  //Lay the key out over a period that is a multiple of both its length and the vector width
+  uint8_t pattern[XOR_PERIOD_MAX + 32];
+  uint32_t i, period = key_len * 32;
+  for(i = 0; i < period + 32; i++)
+    pattern[i] = key[i % key_len];
+
+  //XOR over a packed stream would leave it impossible to decompress
+  int32_t inode = directory[ret].inode;
+  if(inodes[inode].attribute & (1 << COMPRESSED_ATTR))
+  {
+    fsError("File %s is compressed, expand it with attrib -c first\n", filename);
+    pthread_rwlock_unlock(&meta_lock);
+    return;
+  }
+
+  //Only the file's data changes, so other files stay readable meanwhile
+  pthread_rwlock_wrlock(&inode_locks[inode]);
+
+  struct inode *thisInode = &inodes[inode];
+  ret = unshareBlocks(inode, 0, blocksFor(thisInode->file_size));
+  if(ret != FS_OK)
+  {
+    if(ret == FS_EIO) fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+    else fsError("Not enough free space to encrypt %s, it shares blocks with other files\n", filename);
+    pthread_rwlock_unlock(&inode_locks[inode]);
+    pthread_rwlock_unlock(&meta_lock);
+    return;
+  }
+
+  struct extent ext;
+  uint32_t len, offset = 0, remaining = thisInode->file_size;
+
+  //XOR each run of contiguous blocks in a single pass, continuing the key across runs
+  for(i = 0; remaining > 0; i += ext.length)
+  {
+    nextExtent(thisInode, i, blocksFor(remaining), &ext);
+
+    uint8_t *block = pinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length, 0);
+    if(block == NULL)
+    {
+      fsError("Unable to read image %s, %s is only partly encrypted: %s\n", image_name, filename, strerror(errno));
+      break;
+    }
+    len = ext.length * BLOCK_SIZE;
+    if(len > remaining) len = remaining;
+
+    xorKernel(block, len, pattern, period, offset % period);
+    markDirty(block, len);
+    unpinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length);
+
+    offset += len;
+    remaining -= len;
+  }
+
+  pthread_rwlock_unlock(&inode_locks[inode]);
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//----------Read output----------
+//Per thread so concurrent reads don't share a buffer
+__thread char   out_buf[OUT_BUF_SIZE];
+__thread size_t out_len;
+
+//Hex digits for every byte value, unpadded ("%0x ") with its length, and as two digits
+char    hex_byte[256][4];
+uint8_t hex_byte_len[256];
+char    hex_pair[256][2];
+
+void initHexTables()
+{
+  const char *digits = "0123456789abcdef";
+  uint32_t i;
+  for(i = 0; i < 256; i++)
+  {
+    hex_pair[i][0] = digits[i >> 4];
+    hex_pair[i][1] = digits[i & 15];
+
+    hex_byte_len[i] = 0;
+    if(i >= 16) hex_byte[i][hex_byte_len[i]++] = digits[i >> 4];
+    hex_byte[i][hex_byte_len[i]++] = digits[i & 15];
+    hex_byte[i][hex_byte_len[i]++] = ' ';
+  }
+}
+
+void outFlush()
+{
+  if(out_len) fwrite(out_buf, 1, out_len, stdout);
+  out_len = 0;
+}
+
+//Make room for n more bytes in the output buffer
+static inline char *outReserve(size_t n)
+{
+  if(out_len + n > OUT_BUF_SIZE) outFlush();
+  return out_buf + out_len;
+}
+
+//One xxd style line: offset, 8 groups of 2 bytes, then the printable characters
+void outXxdLine(uint32_t offset, uint8_t *bytes, uint32_t count)
+{
+  char *out = outReserve(80);
+  uint32_t i, n = 0;
+
+  for(i = 0; i < 4; i++)
+  {
+    out[n++] = hex_pair[(offset >> (24 - i * 8)) & 0xff][0];
+    out[n++] = hex_pair[(offset >> (24 - i * 8)) & 0xff][1];
+  }
+  out[n++] = ':';
+  out[n++] = ' ';
+
+  for(i = 0; i < 16; i++)
+  {
+    if(i < count)
+    {
+      out[n++] = hex_pair[bytes[i]][0];
+      out[n++] = hex_pair[bytes[i]][1];
+    }
+    else
+    {
+      out[n++] = ' ';
+      out[n++] = ' ';
+    }
+    if(i & 1) out[n++] = ' ';
+  }
+  out[n++] = ' ';
+
+  for(i = 0; i < count; i++)
+    out[n++] = (bytes[i] >= 0x20 && bytes[i] < 0x7f) ? bytes[i] : '.';
+  out[n++] = '\n';
+
+  out_len += n;
+}
+
+//Where a read dump is up to, as the file's bytes are handed over a run at a time
+struct readState {
+  uint8_t  mode;
+  uint8_t  line[16];
+  uint32_t line_len;
+  uint32_t offset;  //File offset of the next byte
+};
+
+//Print the next n bytes of the range being read
+void readOut(struct readState *rs, const uint8_t *bytes, uint32_t n)
+{
+  uint32_t j;
+
+  if(rs->mode == READ_RAW)
+  {
+    outFlush();
+    fwrite(bytes, 1, n, stdout);
+  }
+  else if(rs->mode == READ_XXD)
+  {
+    for(j = 0; j < n; j++)
+    {
+      rs->line[rs->line_len++] = bytes[j];
+      if(rs->line_len == 16)
+      {
+        outXxdLine(rs->offset + j - 15, rs->line, 16);
+        rs->line_len = 0;
+      }
+    }
+  }
+  else
+  {
+    //One line per block, the table entries are padded so a fixed 4 byte copy is safe
+    for(j = 0; j < n; j++)
+    {
+      char *out = outReserve(5);
+      memcpy(out, hex_byte[bytes[j]], 4);
+      out_len += hex_byte_len[bytes[j]];
+      if((rs->offset + j + 1) % BLOCK_SIZE == 0) out_buf[out_len++] = '\n';
+    }
+  }
+
+  rs->offset += n;
+}
+
+//Output hex of specified file, with optional starting byte, and optional number of bytes to read
+//Defaults to read entire file if range not specified.
+//mode READ_XXD prints offsets and fixed columns, READ_RAW writes the bytes unformatted
+void readData(char *file, uint32_t startByte, uint32_t numBytes, uint8_t mode)
+{
+  uint32_t i, len, fileSize;
+  struct inode *thisInode;
+
+  pthread_rwlock_rdlock(&meta_lock);
+  int32_t foundDir = fileExists(file);
+
+  if(foundDir == -1 || isDirectory(foundDir))
+  {
+    if(foundDir == -1) fsError("Read Failed. File %s not found\n", file);
+    else fsError("Read Failed. %s is a directory\n", file);
+    pthread_rwlock_unlock(&meta_lock);
+    return;
+  }
+
+  int32_t inode = directory[foundDir].inode;
+  pthread_rwlock_rdlock(&inode_locks[inode]);
+
+  thisInode = &inodes[inode];
+  fileSize = thisInode->file_size;
+
+  if(startByte > fileSize)
+  {
+    fsError("Impossible starting byte\n");
+    goto out;
+  }
+  if(numBytes > fileSize - startByte)
+  {
+    numBytes = fileSize - startByte;
+    if(mode != READ_RAW) fsInfo("Requested read of too many bytes, reading %u instead\n", numBytes);
+  }
+
+  int32_t bad = verifyBlocks(thisInode, startByte, numBytes);
+  if(bad != -1)
+  {
+    fsError("Read Failed. Block %d, held by %s, failed its checksum\n", bad, file);
+    goto out;
+  }
+
+  //Compressed files are decompressed a chunk at a time into a buffer of their own
+  uint8_t *chunk = NULL;
+  if(thisInode->attribute & (1 << COMPRESSED_ATTR))
+  {
+    chunk = malloc(PACK_CHUNK);
+    if(chunk == NULL)
+    {
+      fsError("Not enough memory to read %s\n", file);
+      goto out;
+    }
+  }
+
+  //Anything printed so far has to come out before the buffered dump, and a dump running on
+  //another thread mustn't interleave with this one
+  flockfile(stdout);
+  fflush(stdout);
+
+  struct readState rs;
+  rs.mode = mode;
+  rs.line_len = 0;
+  rs.offset = startByte;
+  uint32_t remaining = numBytes;
+
+  if(chunk != NULL)
+  {
+    while(remaining > 0)
+    {
+      len = PACK_CHUNK - rs.offset % PACK_CHUNK;
+      if(len > remaining) len = remaining;
+
+      if(unpackRange(thisInode, rs.offset, chunk, len) == -1)
+      {
+        fsError("File %s is damaged, can't decompress it\n", file);
+        break;
+      }
+      readOut(&rs, chunk, len);
+      remaining -= len;
+    }
+  }
+  else
+  {
+    //Real starting byte relative to the first block
+    uint32_t offset = startByte % BLOCK_SIZE, ahead = startByte / BLOCK_SIZE;
+    struct extent ext;
+
+    //Walk the range one run of contiguous blocks at a time
+    for(i = startByte / BLOCK_SIZE; remaining > 0; i += ext.length)
+    {
+      nextExtent(thisInode, i, blocksFor(offset + remaining), &ext);
+      prefetchAhead(thisInode, i + ext.length, i + blocksFor(offset + remaining), &ahead);
+
+      uint8_t *block = pinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length, 0);
+      if(block == NULL)
+      {
+        fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+        break;
+      }
+
+      len = ext.length * BLOCK_SIZE;
+      if(len > offset + remaining) len = offset + remaining;
+
+      readOut(&rs, block + offset, len - offset);
+      unpinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length);
+
+      remaining -= len - offset;
+      offset = 0;
+    }
+  }
+
+  if(mode == READ_HEX && numBytes > 0 && rs.offset % BLOCK_SIZE)
+  {
+    outReserve(1);
+    out_buf[out_len++] = '\n';
+  }
+  if(mode == READ_XXD && rs.line_len) outXxdLine(rs.offset - rs.line_len, rs.line, rs.line_len);
+  outFlush();
+  funlockfile(stdout);
+  free(chunk);
+
+out:
+  pthread_rwlock_unlock(&inode_locks[inode]);
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//Only called when file confirmed to exist, and attr in +/- prefix format
+void set_attribute(uint32_t file_number, char* attr)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+
+  struct directoryEntry thisFile = directory[file_number];
+  struct inode thisInode = inodes[thisFile.inode];
+  uint8_t setBit=0;
+  if(attr[0] == '+') setBit = 1;
+
+  //Compression rewrites the file's blocks, and sets or clears its bit itself
+  if(attr[1] == 'c' && isDirectory(file_number))
+  {
+    fsError("%s is a directory, it can't be compressed\n", thisFile.filename);
+    pthread_rwlock_unlock(&meta_lock);
+    return;
+  }
+  if(attr[1] == 'c')
+  {
+    int ret = setBit ? compressFile(thisFile.inode) : expandFile(thisFile.inode);
+    if(ret == FS_OK && (sb.features & FS_FEATURE_DEDUP)) dedupFile(thisFile.inode);
+    else if(ret == PACK_NO_GAIN) fsInfo("File %s doesn't compress, left as is\n", thisFile.filename);
+    else if(ret == FS_EFBIG) fsError("File %s is too large to store uncompressed\n", thisFile.filename);
+    else if(ret == FS_ENOSPC) fsError("Not enough free space to %s %s\n", setBit ? "compress" : "expand", thisFile.filename);
+    else if(ret == FS_ENOMEM) fsError("Not enough memory to compress %s\n", thisFile.filename);
+    else if(ret == FS_EBADIMG) fsError("File %s is damaged, can't decompress it\n", thisFile.filename);
+    else if(ret == FS_EIO) fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+
+    pthread_rwlock_unlock(&meta_lock);
+    return;
+  }
+
+  //Utilize bitmask, with OR to set bit, or NOT on AND of the byte to unset the bit.
+  if(attr[1] == 'h')
+  {
+    if(setBit) thisInode.attribute |= (1 << HIDDEN_ATTR);
+    else thisInode.attribute &= ~(1 << HIDDEN_ATTR);
+  }
+  else if(attr[1] == 'r')
+  {
+    if(setBit) thisInode.attribute |= (1 << READONLY_ATTR);
+    else thisInode.attribute &= ~(1 << READONLY_ATTR);
+  }
+
+  //Save inode changes
+  inodes[thisFile.inode].attribute = thisInode.attribute;
+  storeInode(&inodes[thisFile.inode]);
+
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//Print one listed entry, with its attribute bits if print_attr
+void listEntry(int32_t entry, uint8_t print_attr)
+{
+  int32_t j;
+  char *slash = isDirectory(entry) ? "/" : "";
+
+  if(print_attr)
+  {
+    printf("%s%s - Attr: ", directory[entry].filename, slash);
+    for(j=7; j>=0; j--)
+    {
+      if((inodes[directory[entry].inode].attribute) & (1 << j)) printf("1");
+      else printf("0");
+    }
+    printf("\n");
+  }
+  else printf("%s%s\n", directory[entry].filename, slash);
+}
+
+//List files within the opened FS image, or in images with directories the ones in directory
+//path, the current one if it is empty. Directories are listed with a / after the name
+//print_attr to include current file attribute state
+//hidden to include hidden files among listed files
+void list(char *path, uint8_t hidden, uint8_t print_attr)
+{
+  int32_t i, not_found = 1;
+
+  pthread_rwlock_rdlock(&meta_lock);
+  flockfile(stdout);
+
+  if(treeDirs())
+  {
+    //The directory's records are together in the index, so only they are read
+    uint32_t dir = walkPath(path, NULL), block, pos;
+    struct dirRecord *rec;
+    if(dir == NO_DIR)
+    {
+      funlockfile(stdout);
+      pthread_rwlock_unlock(&meta_lock);
+      fsError("Directory %s doesn't exist\n", path);
+      return;
+    }
+
+    printf("Contents of image: %s\n",image_name);
+    indexSeek(dir, "", &block, &pos);
+    for(; (rec = indexAt(&block, &pos)) != NULL && rec->parent == dir; pos++)
+    {
+      if(directory[rec->entry].in_use != 1) continue;
+      if(!hidden && (inodes[directory[rec->entry].inode].attribute) & (1 << HIDDEN_ATTR)) continue;
+
+      not_found = 0;
+      listEntry(rec->entry, print_attr);
+    }
+  }
+  else
+  {
+    printf("Contents of image: %s\n",image_name);
+    for(i = 0; i < NUM_FILES; i++)
+    {
+      if(directory[i].in_use != 1) continue;
+      if(!hidden && (inodes[directory[i].inode].attribute) & (1 << HIDDEN_ATTR)) continue;
+
+      not_found = 0;
+      listEntry(i, print_attr);
+    }
+  }
+
+  funlockfile(stdout);
+  pthread_rwlock_unlock(&meta_lock);
+
+  if(not_found) fsInfo("No files found\n");
+}
+
+//Copy len bytes of the image file at src_off into out at dst_off without going through user space
+//Returns 0 on success, or -1 if the kernel can't copy between these files
+int copyFromImage(int src, int out, off_t src_off, off_t dst_off, size_t len)
+{
+  ssize_t n;
+  while(len > 0)
+  {
+    n = copy_file_range(src, &src_off, out, &dst_off, len, 0);
+    if(n == -1 && errno == EINTR) continue;
+    if(n <= 0) break;
+    len -= n;
+  }
+  if(len == 0) return 0;
+
+  //Older kernels and some filesystem pairs refuse copy_file_range, sendfile still avoids the copy
+  if(lseek(out, dst_off, SEEK_SET) == -1) return -1;
+  while(len > 0)
+  {
+    n = sendfile(out, src, &src_off, len);
+    if(n == -1 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    len -= n;
+  }
+  return 0;
+}
+
+//pwritev the runs to out at offset, picking up after short writes. Returns 0 or -1
+int writeRuns(int out, struct iovec *iov, int iovcnt, off_t offset)
+{
+  ssize_t n;
+  while(iovcnt > 0)
+  {
+    n = pwritev(out, iov, iovcnt, offset);
+    if(n == -1 && errno == EINTR) continue;
+    if(n == -1) return -1;
+    offset += n;
+
+    //Drop the runs written completely and trim a partly written one
+    while(iovcnt > 0 && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if(iovcnt > 0)
+    {
+      iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+//Copy specified file from image to the current directory
+//May optionally specify a new filename for the created file
+void retrieve(char *fileToRetrieve, char *newFilename)
+{
+  pthread_rwlock_rdlock(&meta_lock);
+  int32_t file_num = fileExists(fileToRetrieve);
+
+  if(file_num == -1 || isDirectory(file_num))
+  {
+    if(file_num == -1) fsError("Filename %s not found\n",fileToRetrieve);
+    else fsError("%s is a directory\n", fileToRetrieve);
+    pthread_rwlock_unlock(&meta_lock);
+    return;
+  }
+
+  //If no new filename specified, use the current name, without its directories
+  if(newFilename == NULL) newFilename = treeDirs() ? baseName(fileToRetrieve) : fileToRetrieve;
+
+  int32_t inode = directory[file_num].inode;
+  pthread_rwlock_rdlock(&inode_locks[inode]);
+
+  struct inode *thisInode = &inodes[inode];
+
+  //A damaged file mustn't replace anything
+  int32_t bad = verifyBlocks(thisInode, 0, thisInode->file_size);
+  if(bad != -1)
+  {
+    fsError("Block %d, held by %s, failed its checksum\n", bad, fileToRetrieve);
+    pthread_rwlock_unlock(&inode_locks[inode]);
+    pthread_rwlock_unlock(&meta_lock);
+    return;
+  }
+
+  int out = open(newFilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(out == -1)
+  {
+    fsError("Unable to create %s\n", newFilename);
+    pthread_rwlock_unlock(&inode_locks[inode]);
+    pthread_rwlock_unlock(&meta_lock);
+    return;
+  }
+  struct extent ext;
+  uint32_t i, len, remaining, block_count = blocksFor(thisInode->file_size);
+  uint8_t packed = (thisInode->attribute & (1 << COMPRESSED_ATTR)) != 0;
+
+  //The image file only holds the file's current contents if it is mapped, or none of its blocks
+  //changed since the image was read or saved, or are waiting in the journal. Pooled images write
+  //back evicted blocks, so theirs are on disk unless they are dirty.
+  uint8_t on_disk = !packed && (image_mapped || image_pooled || !dirty_all);
+  for(i = 0; on_disk && i < block_count; i += ext.length)
+  {
+    nextExtent(thisInode, i, block_count - i, &ext);
+    uint32_t first = FIRST_DATA_BLOCK + ext.start, end = first + ext.length;
+    if(nextDirty(first, 1) < end || nextMapBit(journal_blocks, first, 1) < end) on_disk = 0;
+  }
+
+  int src = -1;
+  if(on_disk) src = image_mapped || image_pooled ? image_fd : open(image_name, O_RDONLY);
+
+  //Gathered runs of a pooled image stay pinned until they are written
+  struct iovec iov[IOV_MAX];
+  struct extent pinned[IOV_MAX];
+  int iovcnt = 0, j;
+  uint32_t ahead = 0;
+  off_t pos = 0, iov_pos = 0;
+  int failed = 0, ret = FS_OK;
+
+  //Compressed files are decompressed a chunk at a time instead
+  if(packed)
+  {
+    ret = unpackTo(thisInode, out);
+    failed = ret == FS_EIO;
+    if(ret == FS_EBADIMG) fsError("File %s is damaged, can't decompress it\n", fileToRetrieve);
+    else if(ret == FS_ENOMEM) fsError("Not enough memory to retrieve %s\n", fileToRetrieve);
+  }
+
+  //Move each run of contiguous blocks file to file in the kernel when possible, otherwise gather
+  //the runs out of data and write them with one pwritev. The last block may not be full.
+  remaining = packed ? 0 : thisInode->file_size;
+  for(i = 0; remaining > 0 && !failed; i += ext.length)
+  {
+    nextExtent(thisInode, i, blocksFor(remaining), &ext);
+
+    len = ext.length * BLOCK_SIZE;
+    if(len > remaining) len = remaining;
+
+    //Once the kernel refuses, don't keep asking
+    if(src != -1 && copyFromImage(src, out, (off_t)(FIRST_DATA_BLOCK + ext.start) * BLOCK_SIZE, pos, len) == -1)
+    {
+      if(!image_mapped && !image_pooled) close(src);
+      src = -1;
+    }
+
+    if(src != -1)
+    {
+      //Gathered runs have to be contiguous in the output, so write them out before skipping ahead
+      if(iovcnt) failed = writeRuns(out, iov, iovcnt, iov_pos) == -1;
+      for(j = 0; j < iovcnt; j++)
+        unpinBlocks(FIRST_DATA_BLOCK + pinned[j].start, pinned[j].length);
+      iovcnt = 0;
+    }
+    else
+    {
+      prefetchAhead(thisInode, i + ext.length, block_count, &ahead);
+
+      uint8_t *block = pinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length, 0);
+      if(block == NULL)
+      {
+        fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+        break;
+      }
+
+      if(iovcnt == 0) iov_pos = pos;
+      iov[iovcnt].iov_base = block;
+      iov[iovcnt].iov_len = len;
+      pinned[iovcnt] = ext;
+
+      if(++iovcnt == IOV_MAX)
+      {
+        failed = writeRuns(out, iov, iovcnt, iov_pos) == -1;
+        for(j = 0; j < iovcnt; j++)
+          unpinBlocks(FIRST_DATA_BLOCK + pinned[j].start, pinned[j].length);
+        iovcnt = 0;
+      }
+    }
+
+    pos += len;
+    remaining -= len;
+  }
+
+  if(iovcnt && !failed) failed = writeRuns(out, iov, iovcnt, iov_pos) == -1;
+  for(j = 0; j < iovcnt; j++)
+    unpinBlocks(FIRST_DATA_BLOCK + pinned[j].start, pinned[j].length);
+
+  if(failed) fsError("Unable to write %s: %s\n", newFilename, strerror(errno));
+
+  pthread_rwlock_unlock(&inode_locks[inode]);
+  pthread_rwlock_unlock(&meta_lock);
+
+  if(src != -1 && !image_mapped && !image_pooled) close(src);
+  close(out);
+}
+
+//Point the metadata tables at their blocks within data
+void setRegions()
+{
+  directory = (struct directoryEntry *)blockData(sb.directory_block);
+  free_inodes = blockData(sb.free_inodes_block);
+  free_blocks = blockData(sb.free_blocks_block);
+  inode_table = blockData(sb.inodes_block);
+  block_crcs = (sb.features & FS_FEATURE_CRC) ? (uint32_t *)blockData(sb.crc_block) : NULL;
+  cwd = ROOT_DIR;
+}
+
+//Fill in where each table starts for the block size, counts and inode layout in geom
+//The tables have room for max_files files, which only images with indirect blocks grow into
+void layoutImage(struct superblock *geom)
+{
+  uint64_t bs = geom->block_size;
+  uint8_t indirect = (geom->features & FS_FEATURE_INDIRECT) != 0;
+  if(!indirect) geom->max_files = geom->num_files;
+
+  geom->magic = FS_MAGIC;
+  geom->version = FS_VERSION;
+  geom->blocks_per_file = indirect ? mapCapacity(geom->block_size) : BLOCKS_PER_FILE;
+  geom->directory_block = 1;
+  geom->free_inodes_block = geom->directory_block + (geom->max_files * sizeof(struct directoryEntry) + bs - 1) / bs;
+  geom->free_blocks_block = geom->free_inodes_block + (geom->max_files + bs - 1) / bs;
+  geom->inodes_block = geom->free_blocks_block + (geom->num_blocks + bs - 1) / bs;
+  geom->first_data_block = geom->inodes_block +
+    (geom->max_files * (indirect ? sizeof(struct mapInode) : sizeof(struct flatInode)) + bs - 1) / bs;
+
+  geom->index_block = 0;
+  if(geom->features & FS_FEATURE_DIRS)
+  {
+    geom->index_block = geom->first_data_block;
+    geom->first_data_block += indexBlocks(geom->block_size, geom->max_files);
+  }
+
+  //The checksum table holds one uint32_t per block
+  geom->crc_block = 0;
+  if(geom->features & FS_FEATURE_CRC)
+  {
+    geom->crc_block = geom->first_data_block;
+    geom->first_data_block += ((uint64_t)geom->num_blocks * sizeof(uint32_t) + bs - 1) / bs;
+  }
+}
+
+//Check that geom describes an image this build can use. Returns FS_OK or FS_EINVAL
+int checkGeometry(struct superblock *geom)
+{
+  if(geom->block_size < MIN_BLOCK_SIZE || geom->block_size > MAX_BLOCK_SIZE) return FS_EINVAL;
+  if(geom->block_size & (geom->block_size - 1)) return FS_EINVAL;
+  if(geom->num_files == 0 || geom->num_files > MAX_NUM_FILES) return FS_EINVAL;
+  if((geom->features & FS_FEATURE_INDIRECT) && (geom->max_files < geom->num_files || geom->max_files > MAX_NUM_FILES))
+    return FS_EINVAL;
+  if(geom->num_blocks > MAX_NUM_BLOCKS) return FS_EINVAL;
+
+  //The tables have to leave room for at least one data block
+  struct superblock layout = *geom;
+  layoutImage(&layout);
+  if(layout.first_data_block >= geom->num_blocks) return FS_EINVAL;
+
+  return FS_OK;
+}
+
+//Geometry of a new image, zero taking the default. New images have indirect blocks and room for
+//num_files files, by default one for every 16 blocks, of which the directory starts with a few
+void newGeometry(struct superblock *geom, uint32_t block_size, uint32_t num_blocks, uint32_t num_files)
+{
+  memset(geom, 0, sizeof(*geom));
+  geom->block_size = block_size ? block_size : DEFAULT_BLOCK_SIZE;
+  geom->num_blocks = num_blocks ? num_blocks : DEFAULT_NUM_BLOCKS;
+  geom->features = FS_FEATURE_CRC | FS_FEATURE_INDIRECT | FS_FEATURE_DIRS;
+
+  geom->max_files = num_files;
+  if(num_files == 0)
+  {
+    geom->max_files = geom->num_blocks / 16;
+    if(geom->max_files < DEFAULT_NUM_FILES) geom->max_files = DEFAULT_NUM_FILES;
+    if(geom->max_files > MAX_NUM_FILES) geom->max_files = MAX_NUM_FILES;
+  }
+  geom->num_files = geom->max_files < DEFAULT_NUM_FILES ? geom->max_files : DEFAULT_NUM_FILES;
+}
+
+//Geometry of images from before superblocks, with the tables at fixed blocks
+void legacyGeometry(struct superblock *geom)
+{
+  memset(geom, 0, sizeof(*geom));
+  geom->block_size = 1024;
+  geom->num_blocks = 65536;
+  geom->num_files = 256;
+  geom->max_files = 256;
+  geom->blocks_per_file = BLOCKS_PER_FILE;
+  geom->directory_block = 0;
+  geom->free_inodes_block = 18;
+  geom->free_blocks_block = 19;
+  geom->inodes_block = 84;
+  geom->first_data_block = 1364;
+}
+
+//Work out the geometry of an image file of the given size from its first bytes
+//Sets fresh if the file holds no tables yet, an empty file or one with just a superblock
+//Returns FS_OK, FS_EIO or FS_EBADIMG
+int readGeometry(int fd, off_t size, struct superblock *geom, uint8_t *fresh)
+{
+  *fresh = 0;
+
+  //An empty file is formatted with the default geometry
+  if(size == 0)
+  {
+    newGeometry(geom, 0, 0, 0);
+    layoutImage(geom);
+    *fresh = 1;
+    return FS_OK;
+  }
+
+  ssize_t n = pread(fd, geom, sizeof(*geom), 0);
+  if(n == -1) return FS_EIO;
+
+  if(n == sizeof(*geom) && geom->magic == FS_MAGIC)
+  {
+    if(geom->version != FS_VERSION) return FS_EBADIMG;
+    if(geom->features & ~FS_FEATURES) return FS_EBADIMG;
+    if(checkGeometry(geom) != FS_OK) return FS_EBADIMG;
+
+    //The stored table positions must be the ones this geometry implies
+    struct superblock layout = *geom;
+    layoutImage(&layout);
+    if(memcmp(&layout, geom, offsetof(struct superblock, features)) != 0) return FS_EBADIMG;
+    if(layout.crc_block != geom->crc_block || layout.index_block != geom->index_block) return FS_EBADIMG;
+
+    //Superblocks from before FS_FEATURE_INDIRECT have 0 for max_files
+    geom->max_files = layout.max_files;
+
+    if(size > (off_t)geom->num_blocks * geom->block_size) return FS_EBADIMG;
+    if(size == geom->block_size) *fresh = 1;
+    return FS_OK;
+  }
+
+  if(size == (off_t)65536 * 1024)
+  {
+    legacyGeometry(geom);
+    return FS_OK;
+  }
+
+  return FS_EBADIMG;
+}
+
+//Take the feature bits and table checksum from the superblock in data, which a replayed journal
+//may have changed. Returns FS_OK, or FS_EBADIMG for features this build doesn't know
+int loadFeatures()
+{
+  if(sb.magic != FS_MAGIC) return FS_OK;
+
+  struct superblock *stored = (struct superblock *)data;
+  if(stored->features & ~FS_FEATURES) return FS_EBADIMG;
+
+  //The checksum table, inode layout and directory index move the tables, so they can't come or go
+  if((stored->features ^ sb.features) & (FS_FEATURE_CRC | FS_FEATURE_INDIRECT | FS_FEATURE_DIRS)) return FS_EBADIMG;
+
+  //The directory may have grown since the image file's superblock was written
+  if(sb.features & FS_FEATURE_INDIRECT)
+  {
+    if(stored->num_files < sb.num_files || stored->num_files > sb.max_files) return FS_EBADIMG;
+    sb.num_files = stored->num_files;
+  }
+
+  sb.features = stored->features;
+  sb.table_crc = stored->table_crc;
+  sb.open_mapped = stored->open_mapped;
+  return FS_OK;
+}
+
+//Set up the tables that go with the geometry in geom, leaving data for the caller
+//Returns FS_OK or FS_ENOMEM
+int allocTables(struct superblock *geom)
+{
+  uint32_t i;
+
+  sb = *geom;
+  free_map = calloc((NUM_DATA_BLOCKS + 63) / 64, sizeof(uint64_t));
+  dirty_blocks = calloc(blockMapSize(), 1);
+  journal_blocks = calloc(blockMapSize(), 1);
+  inodes = calloc(sb.max_files, sizeof(struct inode));
+  parents = calloc(sb.max_files, sizeof(uint32_t));
+  inode_locks = malloc(sb.max_files * sizeof(pthread_rwlock_t));
+  if(free_map == NULL || dirty_blocks == NULL || journal_blocks == NULL || inodes == NULL || parents == NULL ||
+     inode_locks == NULL)
+    return FS_ENOMEM;
+
+  //Every inode the directory can grow to has its lock from the start
+  for(i = 0; i < sb.max_files; i++)
+    pthread_rwlock_init(&inode_locks[i], NULL);
+
+  return FS_OK;
+}
+
+//Give the image an anonymous, zeroed memory area, untouched pages of it cost nothing
+//Returns FS_OK or FS_ENOMEM
+int allocData()
+{
+  void *mem = mmap(NULL, (size_t)NUM_BLOCKS * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(mem == MAP_FAILED) return FS_ENOMEM;
+
+  data = mem;
+  setRegions();
+  return FS_OK;
+}
+
+//Drop the memory, mapping and tables of the current image, if any
+void releaseImage()
+{
+  uint32_t i;
+
+  //Mapped and pooled images keep their changes, and their checksums have to follow them
+  if(image_open && image_mapped)
+  {
+    updateChecksums();
+    if(sb.magic == FS_MAGIC) markMapped(0);
+  }
+  if(image_open && image_pooled) saveImage();
+
+  if(data != NULL) munmap(data, (size_t)NUM_BLOCKS * BLOCK_SIZE);
+  if(image_mapped || image_pooled) close(image_fd);
+
+  if(inode_locks != NULL)
+  {
+    for(i = 0; i < sb.max_files; i++)
+      pthread_rwlock_destroy(&inode_locks[i]);
+  }
+
+  dropFingerprints();
+  free(unit_flags);
+  free(unit_pins);
+  free(pool_ring);
+  unit_flags = NULL;
+  unit_pins = NULL;
+  pool_ring = NULL;
+  pool_ring_size = 0;
+  pool_resident = 0;
+  pool_hand = 0;
+  free(free_map);
+  free(dirty_blocks);
+  free(journal_blocks);
+  free(inodes);
+  free(parents);
+  free(inode_locks);
+  free_map = NULL;
+  dirty_blocks = NULL;
+  journal_blocks = NULL;
+  inode_locks = NULL;
+  free_block_count = 0;
+
+  data = NULL;
+  directory = NULL;
+  inodes = NULL;
+  parents = NULL;
+  inode_table = NULL;
+  free_inodes = NULL;
+  free_blocks = NULL;
+  image_fd = -1;
+  image_mapped = 0;
+  image_pooled = 0;
+  image_open = 0;
+  memset(&sb, 0, sizeof(sb));
+
+  //Lookups without an image find nothing
+  buildIndex();
+}
+
+//Write empty tables, and the superblock unless the image predates them, into zeroed data
+//All zeros is already an empty directory and inode table: entries without a name are unused
+//and block pointers past a file's size are never read. Only the free maps need filling.
+void formatTables()
+{
+  if(sb.magic == FS_MAGIC)
+  {
+    memcpy(data, &sb, sizeof(sb));
+    markDirty(data, sizeof(sb));
+  }
+
+  memset(free_inodes, 1, NUM_FILES);
+  markDirty(free_inodes, NUM_FILES);
+  memset(free_blocks, 1, NUM_BLOCKS);
+  markDirty(free_blocks, NUM_BLOCKS);
+
+  formatChecksums();
+}
+
+//Used to initialize the program, no image is open until createfs or open
+void init()
+{
+  selectXorKernel();
+  initHexTables();
+  initCrcTables();
+  selectCrcKernel();
+
+  releaseImage();
+  memset(image_name, 0, 64);
+}
+
+//Print total data free in the open image
+uint64_t df()
+{
+  pthread_mutex_lock(&alloc_lock);
+  uint64_t free_bytes = (uint64_t)free_block_count * BLOCK_SIZE;
+  pthread_mutex_unlock(&alloc_lock);
+
+  return free_bytes;
+}
+
+//Bytes of blocks held by files, and the bytes of data they hold, which is more when files are
+//compressed or share blocks
+void dfUsage(uint64_t *stored, uint64_t *logical)
+{
+  uint32_t i;
+  *logical = 0;
+
+  pthread_rwlock_rdlock(&meta_lock);
+  for(i = 0; i < NUM_FILES; i++)
+    if(inodes[i].in_use) *logical += inodes[i].file_size;
+
+  pthread_mutex_lock(&alloc_lock);
+  *stored = (uint64_t)(NUM_DATA_BLOCKS - free_block_count) * BLOCK_SIZE;
+  pthread_mutex_unlock(&alloc_lock);
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+//----------Journal----------
+//Saves of an image opened without -m go to <image>.journal instead of the image file. Each save
+//appends one transaction: a journalHeader, the block numbers, the blocks themselves and a
+//journalCommit with a checksum of all of it, then a single fdatasync. The image file is only
+//written when the journal is checkpointed, after it has grown past JOURNAL_CHECKPOINT_SIZE,
+//and opening an image replays every complete transaction before using it. A save that is cut
+//short leaves a transaction without a valid commit record, which replay ignores.
+//Mapped images are written back by the kernel at any time, so they are only msync'd.
+struct journalHeader {
+  uint32_t magic;
+  uint32_t count;
+};
+
+struct journalCommit {
+  uint32_t magic;
+  uint32_t count;
+  uint64_t checksum;
+};
+
+char journal_path[80];
+
+//Forget the journal state of the previous image and point at the current one's journal
+void journalReset()
+{
+  if(journal_blocks != NULL) memset(journal_blocks, 0, blockMapSize());
+  journal_size = 0;
+  snprintf(journal_path, sizeof(journal_path), "%s.journal", image_name);
+}
+
+//Write the blocks set in map from data to the image file and flush it to disk
+int writeImageBlocks(const uint8_t *map)
+{
+  int fd = open(image_name, O_WRONLY | O_CREAT, 0644);
+  if(fd == -1) return FS_EIO;
+
+  //Write each run of neighbouring blocks with a single positioned write
+  uint32_t start = nextMapBit(map, 0, 1), end;
+  while(start < NUM_BLOCKS)
+  {
+    end = nextMapBit(map, start, 0);
+
+    size_t len = (size_t)(end - start) * BLOCK_SIZE, done = 0;
+    while(done < len)
+    {
+      ssize_t n = pwrite(fd, blockData(start) + done, len - done, (off_t)start * BLOCK_SIZE + done);
+      if(n == -1)
+      {
+        close(fd);
+        return FS_EIO;
+      }
+      done += n;
+    }
+
+    start = nextMapBit(map, end, 1);
+  }
+
+  if(fsync(fd) == -1)
+  {
+    close(fd);
+    return FS_EIO;
+  }
+  close(fd);
+  return FS_OK;
+}
+
+//Append the dirty blocks to the journal as one transaction. Returns FS_OK or FS_EIO
+int journalCommit()
+{
+  uint32_t count = 0, i = 0, start, end;
+  for(start = nextDirty(0, 1); start < NUM_BLOCKS; start = nextDirty(start + 1, 1))
+    count++;
+  if(count == 0) return FS_OK;
+
+  uint32_t *table = malloc(count * sizeof(uint32_t));
+  if(table == NULL) return FS_EIO;
+  for(start = nextDirty(0, 1); start < NUM_BLOCKS; start = nextDirty(start + 1, 1))
+    table[i++] = start;
+
+  struct journalHeader header = { JOURNAL_MAGIC, count };
+  struct journalCommit commit = { JOURNAL_COMMIT, count, 0 };
+  commit.checksum = checksum(&header, sizeof(header), 14695981039346656037ULL);
+  commit.checksum = checksum(table, count * sizeof(uint32_t), commit.checksum);
+
+  int fd = open(journal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1)
+  {
+    free(table);
+    return FS_EIO;
+  }
+
+  int failed = writeFully(fd, &header, sizeof(header)) == -1 ||
+               writeFully(fd, table, count * sizeof(uint32_t)) == -1;
+
+  //The blocks go out one run of neighbours at a time, straight from data
+  start = nextDirty(0, 1);
+  while(!failed && start < NUM_BLOCKS)
+  {
+    end = nextDirty(start, 0);
+    size_t len = (size_t)(end - start) * BLOCK_SIZE;
+    commit.checksum = checksum(blockData(start), len, commit.checksum);
+    failed = writeFully(fd, blockData(start), len) == -1;
+    start = nextDirty(end, 1);
+  }
+
+  if(!failed) failed = writeFully(fd, &commit, sizeof(commit)) == -1 || fdatasync(fd) == -1;
+  free(table);
+
+  //Cut a partly written transaction off again, later ones appended after it would never replay
+  if(failed)
+  {
+    int saved = errno;
+    if(ftruncate(fd, journal_size) == 0) errno = saved;
+    close(fd);
+    return FS_EIO;
+  }
+
+  journal_size = lseek(fd, 0, SEEK_END);
+  close(fd);
+
+  for(i = 0; i < blockMapSize(); i++)
+    journal_blocks[i] |= dirty_blocks[i];
+
+  return FS_OK;
+}
+
+//Write everything committed to the journal back to the image, then empty the journal
+//data must hold exactly the committed state, so this only runs straight after a commit or replay
+int journalCheckpoint()
+{
+  if(image_mapped)
+  {
+    if(msync(data, (size_t)NUM_BLOCKS * BLOCK_SIZE, MS_SYNC) == -1) return FS_EIO;
+  }
+  else if(writeImageBlocks(journal_blocks) != FS_OK) return FS_EIO;
+
+  if(truncate(journal_path, 0) == -1 && errno != ENOENT) return FS_EIO;
+
+  memset(journal_blocks, 0, blockMapSize());
+  journal_size = 0;
+  return FS_OK;
+}
+
+//Apply every complete transaction in the journal to data and checkpoint them. Returns FS_OK or FS_EIO
+int journalReplay()
+{
+  int fd = open(journal_path, O_RDONLY);
+  if(fd == -1) return errno == ENOENT ? FS_OK : FS_EIO;
+
+  struct journalHeader header;
+  struct journalCommit commit;
+  uint32_t *table = NULL, i;
+  uint8_t *blocks = NULL;
+
+  while(readFully(fd, (uint8_t *)&header, sizeof(header)) == sizeof(header))
+  {
+    if(header.magic != JOURNAL_MAGIC || header.count == 0 || header.count > NUM_BLOCKS) break;
+
+    size_t table_len = header.count * sizeof(uint32_t);
+    size_t blocks_len = (size_t)header.count * BLOCK_SIZE;
+    uint32_t *new_table = realloc(table, table_len);
+    uint8_t *new_blocks = realloc(blocks, blocks_len);
+    if(new_table) table = new_table;
+    if(new_blocks) blocks = new_blocks;
+    if(new_table == NULL || new_blocks == NULL) break;
+
+    if(readFully(fd, (uint8_t *)table, table_len) != (ssize_t)table_len) break;
+    if(readFully(fd, blocks, blocks_len) != (ssize_t)blocks_len) break;
+    if(readFully(fd, (uint8_t *)&commit, sizeof(commit)) != sizeof(commit)) break;
+
+    uint64_t sum = checksum(&header, sizeof(header), 14695981039346656037ULL);
+    sum = checksum(table, table_len, sum);
+    sum = checksum(blocks, blocks_len, sum);
+    if(commit.magic != JOURNAL_COMMIT || commit.count != header.count || commit.checksum != sum) break;
+
+    for(i = 0; i < header.count && table[i] < NUM_BLOCKS; i++);
+    if(i < header.count) break;
+
+    for(i = 0; i < header.count; i++)
+    {
+      memcpy(blockData(table[i]), blocks + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+      journal_blocks[table[i] >> 3] |= 1 << (table[i] & 7);
+    }
+  }
+
+  free(table);
+  free(blocks);
+  close(fd);
+
+  //Anything after the last complete transaction is a save that never finished
+  return journalCheckpoint();
+}
+
+//Reset the in-memory image to an empty filesystem named filename and create its file
+//Zero for any of the sizes takes the default. The file is sparse: it is sized with ftruncate
+//and only the superblock and free maps are written, the rest reads back as zeros
+//Returns FS_OK, FS_EINVAL for a geometry that can't be used, FS_ENOMEM or FS_EIO
+int formatImage(char *filename, uint32_t block_size, uint32_t num_blocks, uint32_t num_files)
+{
+  struct superblock geom;
+  newGeometry(&geom, block_size, num_blocks, num_files);
+  if(checkGeometry(&geom) != FS_OK) return FS_EINVAL;
+  layoutImage(&geom);
+
+  releaseImage();
+
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) return FS_EIO;
+
+  memset(image_name, 0, 64);
+  strncpy(image_name, filename, 63);
+
+  //A journal left by an earlier image of the same name must never be replayed onto this one
+  journalReset();
+  int ret = FS_EIO;
+  if(unlink(journal_path) == -1 && errno != ENOENT) goto fail;
+  if(ftruncate(fd, (off_t)geom.num_blocks * geom.block_size) == -1) goto fail;
+  close(fd);
+  fd = -1;
+
+  ret = allocTables(&geom);
+  if(ret == FS_OK) ret = allocData();
+  if(ret != FS_OK) goto fail;
+
+  formatTables();
+  loadTables();
+  updateChecksums();
+
+  ret = writeImageBlocks(dirty_blocks);
+  if(ret != FS_OK) goto fail;
+  clearDirty();
+
+  image_open = 1;
+  return FS_OK;
+
+fail:
+  if(fd != -1) close(fd);
+  releaseImage();
+  memset(image_name, 0, 64);
+  return ret;
+}
+
+//Create new FS image with specified file name
+//Zero for the block size, block count or file count takes the default
+void createfs(char *filename, uint32_t block_size, uint32_t num_blocks, uint32_t num_files)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+  int ret = formatImage(filename, block_size, num_blocks, num_files);
+  pthread_rwlock_unlock(&meta_lock);
+
+  if(ret == FS_EINVAL)
+    fsError("Invalid geometry. Block size must be a power of two from %d to %d, with room for "
+            "1 to %d files and at least one data block\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE, MAX_NUM_FILES);
+  else if(ret == FS_ENOMEM)
+    fsError("Not enough memory for image %s\n", filename);
+  else if(ret != FS_OK)
+    fsError("Unable to create image %s: %s\n", filename, strerror(errno));
+}
+
+//Write the changes to the open image back to its file. Returns FS_OK, FS_ENOIMG or FS_EIO
+int saveImage()
+{
+  if(image_open == 0) return FS_ENOIMG;
+
+  updateChecksums();
+
+  //Pooled images are written in place, blocks evicted since the last save have gone out already
+  if(image_pooled)
+  {
+    if(writeImageBlocks(dirty_blocks) != FS_OK) return FS_EIO;
+    clearDirty();
+    return FS_OK;
+  }
+
+  //Mapped images are written through the page cache, only flush dirty pages
+  if(image_mapped)
+  {
+    long page = sysconf(_SC_PAGESIZE);
+    uint32_t start = nextDirty(0, 1), end;
+    while(start < NUM_BLOCKS)
+    {
+      end = nextDirty(start, 0);
+
+      //msync needs a page aligned address
+      uintptr_t first = (uintptr_t)blockData(start) & ~(uintptr_t)(page - 1);
+      uintptr_t last = (uintptr_t)blockData(end);
+      if(msync((void *)first, last - first, MS_SYNC) == -1) return FS_EIO;
+
+      start = nextDirty(end, 1);
+    }
+    clearDirty();
+    return FS_OK;
+  }
+
+  //A new or short image file is written out whole, anything journaled before is part of it
+  if(dirty_all)
+  {
+    memset(dirty_blocks, 0xff, blockMapSize());
+    if(writeImageBlocks(dirty_blocks) != FS_OK) return FS_EIO;
+
+    journalReset();
+    if(truncate(journal_path, 0) == -1 && errno != ENOENT) return FS_EIO;
+    clearDirty();
+    return FS_OK;
+  }
+
+  //Every change since the last save goes to the journal under a single fsync
+  if(journalCommit() != FS_OK) return FS_EIO;
+  clearDirty();
+
+  if(journal_size >= JOURNAL_CHECKPOINT_SIZE) return journalCheckpoint();
+  return FS_OK;
+}
+
+//Save changes to the open image
+void savefs()
+{
+  pthread_rwlock_wrlock(&meta_lock);
+  int ret = saveImage();
+  pthread_rwlock_unlock(&meta_lock);
+
+  if(ret == FS_ENOIMG)
+  {
+    fsError("No image open to be saved\n");
+    return;
+  }
+  if(ret != FS_OK)
+  {
+    fsError("Failed to save image %s: %s\n", image_name, strerror(errno));
+    return;
+  }
+
+  fsInfo("Saved image: %s\n",image_name);
+}
+
+//Read the first len bytes of an image file into data, which is zeroed, skipping holes
+//Falls back to reading everything where the filesystem can't report holes. Returns 0 or -1
+int readImage(int fd, off_t len)
+{
+  off_t pos = 0, end;
+  while(pos < len)
+  {
+    pos = lseek(fd, pos, SEEK_DATA);
+    if(pos == -1 && errno == ENXIO) return 0;
+    if(pos == -1 && errno == EINVAL) break;
+    if(pos == -1) return -1;
+    if(pos >= len) return 0;
+
+    end = lseek(fd, pos, SEEK_HOLE);
+    if(end == -1) return -1;
+    if(end > len) end = len;
+
+    if(lseek(fd, pos, SEEK_SET) == -1) return -1;
+    if(readFully(fd, data + pos, end - pos) == -1) return -1;
+    pos = end;
+  }
+  if(pos >= len) return 0;
+
+  if(lseek(fd, 0, SEEK_SET) == -1) return -1;
+  return readFully(fd, data, len) == -1 ? -1 : 0;
+}
+
+//Read a whole image file into memory. Returns FS_OK, FS_EIO, FS_ENOMEM, FS_EBADIMG or FS_ECORRUPT
+//Images from before superblocks are recognised by their size
+int loadImage(char *filename)
+{
+  releaseImage();
+
+  int fd = open(filename, O_RDONLY);
+  if(fd == -1) return FS_EIO;
+
+  struct stat buf;
+  struct superblock geom;
+  uint8_t fresh;
+  int ret = FS_EIO;
+
+  if(fstat(fd, &buf) == -1) goto fail;
+  ret = readGeometry(fd, buf.st_size, &geom, &fresh);
+  if(ret != FS_OK) goto fail;
+
+  //Only a file without tables yet may be short, anything else has lost part of the image
+  off_t size = (off_t)geom.num_blocks * geom.block_size;
+  ret = FS_EBADIMG;
+  if(!fresh && buf.st_size != size) goto fail;
+
+  ret = allocTables(&geom);
+  if(ret == FS_OK) ret = allocData();
+  if(ret != FS_OK) goto fail;
+
+  memset(image_name, 0, 64);
+  strncpy(image_name, filename, 63);
+
+  int failed = readImage(fd, size) == -1;
+  close(fd);
+  if(failed)
+  {
+    releaseImage();
+    memset(image_name, 0, 64);
+    return FS_EIO;
+  }
+
+  //A file without tables yet has all of it to write on the next save
+  clearDirty();
+  if(fresh) formatTables();
+  if(fresh) dirty_all = 1;
+
+  //Bring in whatever was saved to the journal but not written back before the last close
+  journalReset();
+  if(journalReplay() != FS_OK)
+  {
+    releaseImage();
+    memset(image_name, 0, 64);
+    return FS_EIO;
+  }
+
+  ret = loadFeatures();
+  if(ret == FS_OK && !fresh) ret = verifyTables();
+  if(ret == FS_OK) loadTables();
+  if(ret == FS_OK) recoverChecksums();
+  if(ret == FS_OK && (sb.features & FS_FEATURE_DEDUP) && buildFingerprints() != FS_OK) ret = FS_ENOMEM;
+  if(ret != FS_OK)
+  {
+    releaseImage();
+    memset(image_name, 0, 64);
+    return ret;
+  }
+
+  image_open = 1;
+  return FS_OK;
+
+fail:
+  releaseImage();
+  close(fd);
+  return ret;
+}
+
+//To open or change the current open FS image
+void openfs(char *filename)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+  int ret = loadImage(filename);
+  pthread_rwlock_unlock(&meta_lock);
+
+  if(ret == FS_EBADIMG) fsError("%s is not a valid image\n", filename);
+  else if(ret == FS_ECORRUPT) fsError("Image %s is damaged, its tables fail their checksums\n", filename);
+  else if(ret == FS_ENOMEM) fsError("Not enough memory for image %s\n", filename);
+  else if(ret != FS_OK) fsError("Unable to open image %s: %s\n", filename, strerror(errno));
+}
+
+//Map an image file into memory instead of reading it in
+//The metadata tables and data blocks point straight into the mapping, so
+//changes are written through to the file and saving only flushes them
+//Returns FS_OK, FS_EIO, FS_ENOMEM, FS_EBADIMG or FS_ECORRUPT
+int mapImage(char *filename)
+{
+  releaseImage();
+
+  int fd = open(filename, O_RDWR);
+  if(fd == -1) return FS_EIO;
+
+  struct stat buf;
+  struct superblock geom;
+  uint8_t fresh;
+  int ret = FS_EIO;
+
+  if(fstat(fd, &buf) == -1) goto fail;
+  ret = readGeometry(fd, buf.st_size, &geom, &fresh);
+  if(ret != FS_OK) goto fail;
+
+  //A file without tables yet is grown to full size and formatted in place
+  off_t size = (off_t)geom.num_blocks * geom.block_size;
+  ret = FS_EIO;
+  if(fresh && ftruncate(fd, size) == -1) goto fail;
+
+  ret = FS_EBADIMG;
+  if(!fresh && buf.st_size != size) goto fail;
 
-//Use provided 1 byte cipher to encrypt specified file
-void encryptFile(char *filename, uint8_t cipher)
-{
-  int32_t ret = fileExists(filename);
-  if(ret == -1)
+  ret = allocTables(&geom);
+  if(ret != FS_OK) goto fail;
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
   {
-    printf("Error: File %s doesn't exist\n", filename);
-    return;
+    releaseImage();
+    close(fd);
+    return FS_EIO;
   }
 
-  struct inode thisInode = inodes[directory[ret].inode];
+  data = map;
+  image_fd = fd;
+  image_mapped = 1;
+  setRegions();
+  clearDirty();
 
-  uint32_t i, j, block_count, remainder, fileSize = thisInode.file_size;
-  
-  block_count = fileSize / BLOCK_SIZE;
+  memset(image_name, 0, 64);
+  strncpy(image_name, filename, 63);
 
-  if(block_count < 1)
+  //A journal left by an image that was opened without -m gets applied to the mapping
+  journalReset();
+  if(!fresh && journalReplay() != FS_OK)
   {
-    remainder = fileSize % BLOCK_SIZE;
-    for(i = 0; i < remainder; i++)
-      data[ FIRST_DATA_BLOCK + thisInode.blocks[0] ][ i ] ^= cipher;
+    releaseImage();
+    memset(image_name, 0, 64);
+    return FS_EIO;
   }
-  else
+
+  if(fresh) formatTables();
+
+  ret = loadFeatures();
+  if(ret == FS_OK && !fresh) ret = verifyTables();
+  if(ret == FS_OK) loadTables();
+  if(ret == FS_OK) recoverChecksums();
+  if(ret == FS_OK && (sb.features & FS_FEATURE_DEDUP) && buildFingerprints() != FS_OK) ret = FS_ENOMEM;
+  if(ret != FS_OK)
   {
-    for(i = 0; i < block_count; i++)
-      for(j = 0; j < BLOCK_SIZE; j++)
-        data[ FIRST_DATA_BLOCK + thisInode.blocks[i] ][j] ^= cipher;
-    
-    //In case incomplete final block
-    remainder = fileSize % BLOCK_SIZE;
-    for(j = 0; j < remainder; j++)
-      data[ FIRST_DATA_BLOCK + thisInode.blocks[i] ][j] ^= cipher;
+    releaseImage();
+    memset(image_name, 0, 64);
+    return ret;
   }
+
+  //Until it is closed the checksums may fall behind what is in the file
+  if(sb.magic == FS_MAGIC) markMapped(1);
+  image_open = 1;
+  return FS_OK;
+
+fail:
+  releaseImage();
+  close(fd);
+  return ret;
 }
 
-//Output hex of specified file, with optional starting byte, and optional number of bytes to read
-//Defaults to read entire file if range not specified.
-void readData(char *file, uint32_t startByte, uint32_t numBytes)
+//Open an image by mapping it into memory instead of reading it in
+void openfs_mmap(char *filename)
 {
-  uint32_t i, j, fileSize;
-  struct inode thisInode;
-  int32_t foundDir = fileExists(file);
+  pthread_rwlock_wrlock(&meta_lock);
+  int ret = mapImage(filename);
+  pthread_rwlock_unlock(&meta_lock);
+
+  if(ret == FS_EBADIMG) fsError("%s is not a valid image\n", filename);
+  else if(ret == FS_ECORRUPT) fsError("Image %s is damaged, its tables fail their checksums\n", filename);
+  else if(ret == FS_ENOMEM) fsError("Not enough memory for image %s\n", filename);
+  else if(ret != FS_OK) fsError("Unable to open image %s: %s\n", filename, strerror(errno));
+}
+
+//Open an image with only its tables in memory, reading data blocks in as they are used and
+//keeping about pool_size bytes of them, see the Buffer pool section. Changes are written back to
+//the image file in place. Returns FS_OK, FS_EIO, FS_ENOMEM, FS_EBADIMG or FS_ECORRUPT
+int poolImage(char *filename, uint64_t pool_size)
+{
+  releaseImage();
+
+  int fd = open(filename, O_RDWR);
+  if(fd == -1) return FS_EIO;
 
-  if(foundDir == -1)
+  struct stat buf;
+  struct superblock geom;
+  uint8_t fresh;
+  int ret = FS_EIO;
+
+  if(fstat(fd, &buf) == -1) goto fail;
+  ret = readGeometry(fd, buf.st_size, &geom, &fresh);
+  if(ret != FS_OK) goto fail;
+
+  //Like a mapped image, a file without tables yet is grown to full size and formatted in place
+  off_t size = (off_t)geom.num_blocks * geom.block_size;
+  ret = FS_EIO;
+  if(fresh && ftruncate(fd, size) == -1) goto fail;
+
+  ret = FS_EBADIMG;
+  if(!fresh && buf.st_size != size) goto fail;
+
+  ret = allocTables(&geom);
+  if(ret == FS_OK) ret = allocData();
+  if(ret != FS_OK) goto fail;
+
+  //Units are whole pages, so their memory can be handed back, and whole blocks
+  long page = sysconf(_SC_PAGESIZE);
+  pool_unit_blocks = page > (long)BLOCK_SIZE ? page / BLOCK_SIZE : 1;
+  pool_first_unit = (FIRST_DATA_BLOCK + pool_unit_blocks - 1) / pool_unit_blocks;
+  pool_limit = pool_size / ((uint64_t)pool_unit_blocks * BLOCK_SIZE);
+  if(pool_limit == 0) pool_limit = 1;
+
+  unit_flags = calloc(poolUnits(), 1);
+  unit_pins = calloc(poolUnits(), sizeof(uint16_t));
+  if(unit_flags == NULL || unit_pins == NULL)
   {
-    printf("Error: Read Failed. File %s not found\n", file);
-    return;
+    ret = FS_ENOMEM;
+    goto fail;
   }
 
-  thisInode = inodes[directory[foundDir].inode];
-  fileSize = thisInode.file_size;
+  ret = FS_EIO;
+  if(readImage(fd, (off_t)pool_first_unit * pool_unit_blocks * BLOCK_SIZE) == -1) goto fail;
 
-  if(startByte > fileSize)
+  image_fd = fd;
+  image_pooled = 1;
+  clearDirty();
+
+  memset(image_name, 0, 64);
+  strncpy(image_name, filename, 63);
+
+  //Replay goes through data, then the checkpoint writes it to the file and the pool starts empty
+  journalReset();
+  if(!fresh && journalReplay() != FS_OK)
   {
-    printf("Error: Impossible starting byte\n");
-    return;
+    releaseImage();
+    memset(image_name, 0, 64);
+    return FS_EIO;
   }
-  if((startByte + numBytes) > fileSize)
+  uint32_t first = pool_first_unit * pool_unit_blocks;
+  if(first < NUM_BLOCKS) madvise(blockData(first), (size_t)(NUM_BLOCKS - first) * BLOCK_SIZE, MADV_DONTNEED);
+
+  if(fresh) formatTables();
+
+  ret = loadFeatures();
+  if(ret == FS_OK && !fresh) ret = verifyTables();
+  if(ret == FS_OK) loadTables();
+  if(ret == FS_OK) recoverChecksums();
+  if(ret == FS_OK && pinMaps() == -1) ret = FS_EIO;
+  if(ret == FS_OK && (sb.features & FS_FEATURE_DEDUP) && buildFingerprints() != FS_OK) ret = FS_ENOMEM;
+  if(ret != FS_OK)
   {
-    numBytes = fileSize - startByte;
-    printf("Requested read of too many bytes, reading %d instead\n", numBytes);
+    releaseImage();
+    memset(image_name, 0, 64);
+    return ret;
   }
 
-  uint32_t startingBlock = startByte / BLOCK_SIZE;
-  
-  //Real starting byte relative to the first block
-  startByte = startByte % BLOCK_SIZE;
+  image_open = 1;
+  return FS_OK;
 
-  //Bytes left to read from first block
-  uint32_t remainder = BLOCK_SIZE - startByte;
-  
-  //Cover edge case where numBytes to read is less than what's left of the first block
-  if(remainder > numBytes) remainder = numBytes;
+fail:
+  releaseImage();
+  close(fd);
+  return ret;
+}
 
-  uint32_t blockToRead = FIRST_DATA_BLOCK + thisInode.blocks[startingBlock];
+//Open an image with a bounded pool of data blocks in memory, pool_mb megabytes of them
+void openfs_pool(char *filename, uint32_t pool_mb)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+  int ret = poolImage(filename, (uint64_t)pool_mb << 20);
+  pthread_rwlock_unlock(&meta_lock);
+
+  if(ret == FS_EBADIMG) fsError("%s is not a valid image\n", filename);
+  else if(ret == FS_ECORRUPT) fsError("Image %s is damaged, its tables fail their checksums\n", filename);
+  else if(ret == FS_ENOMEM) fsError("Not enough memory for image %s\n", filename);
+  else if(ret != FS_OK) fsError("Unable to open image %s: %s\n", filename, strerror(errno));
+}
 
-//---Read First block---
-  for(i = 0; i < remainder; i++)
-    printf("%0x ", data[blockToRead][i]);
-  
-  printf("\n");
+//Close the opened image without saving, except for mapped images which write through and
+//pooled images, which are saved. Returns FS_OK, FS_ENOIMG or FS_EIO if a pooled image couldn't be saved
+int closeImage()
+{
+  if(image_open == 0) return FS_ENOIMG;
 
-  numBytes -= remainder;
+  //A pooled image writes back whatever is left in its pool
+  int ret = image_pooled ? saveImage() : FS_OK;
 
-  uint32_t currBlock, numBlocksToRead = numBytes / BLOCK_SIZE;
+  releaseImage();
+  memset(image_name, 0, 64);
+  return ret;
+}
 
-//---Read middle block(s)---
-  for(i = startingBlock+1; i <= numBlocksToRead; i++)
-  {
-    currBlock = thisInode.blocks[i];
-    for(j = 0; j < BLOCK_SIZE; j++)
-      printf("%0x ", data[currBlock + FIRST_DATA_BLOCK][j]);
-    
-    printf("\n");
-  }
+//Close the opened image if there's one
+//Does not save changes if any, except for mapped images which write through and pooled images
+void closefs()
+{
+  char name[64];
 
-  numBytes -= (numBlocksToRead * BLOCK_SIZE);
-  
-  if(numBytes == 0) return;
-  
-  currBlock = thisInode.blocks[i];
+  pthread_rwlock_wrlock(&meta_lock);
+  memcpy(name, image_name, sizeof(name));
+  int ret = closeImage();
+  pthread_rwlock_unlock(&meta_lock);
 
-//---Read last block---
-  for(j=0; j<numBytes; j++)
-    printf("%0x ", data[currBlock + FIRST_DATA_BLOCK][j]);
-  
-  printf("\n");
+  if(ret == FS_ENOIMG) fsError("Disk image not open\n");
+  else if(ret != FS_OK) fsError("Failed to save image %s: %s\n", name, strerror(errno));
 }
 
-//Only called when file confirmed to exist, and attr in +/- prefix format
-void set_attribute(uint32_t file_number, char* attr)
+//Double the directory and inode table of an image with indirect blocks, up to the max_files
+//the tables were laid out for. Caller holds meta_lock exclusive. Returns FS_OK or FS_ENFILE
+int growDirectory()
 {
-  struct directoryEntry thisFile = directory[file_number];
-  struct inode thisInode = inodes[thisFile.inode];
-  uint8_t setBit=0;
-  if(attr[0] == '+') setBit = 1;
+  if(!indirectInodes() || sb.num_files == sb.max_files) return FS_ENFILE;
 
-  //Utilize bitmask, with OR to set bit, or NOT on AND of the byte to unset the bit.
-  if(attr[1] == 'h')
-  {
-    if(setBit) thisInode.attribute |= (1 << HIDDEN_ATTR);
-    else thisInode.attribute &= ~(1 << HIDDEN_ATTR);
-  }
-  else if(attr[1] == 'r')
+  uint32_t first = sb.num_files;
+  uint32_t count = first < sb.max_files - first ? first : sb.max_files - first;
+
+  //The new entries and inodes are still zero from formatting, only the free map needs filling
+  memset(&free_inodes[first], 1, count);
+  markDirty(&free_inodes[first], count);
+  loadInodes(first, count);
+
+  sb.num_files += count;
+  memcpy(data, &sb, sizeof(sb));
+  markDirty(data, sizeof(sb));
+  buildIndex();
+  return FS_OK;
+}
+
+//The inode last reserved as it was before, which a deleted file may still point from
+static uint8_t reserved_disk[sizeof(struct flatInode)];
+
+//Find a free directory entry and inode for a new file, growing the directory if it is full
+//A caller that fails before commitFile hands the inode back with cancelFile, after releasing
+//any blocks it gave it. Returns FS_OK, or FS_ENFILE with entry or inode left at -1
+int reserveFile(int32_t *entry, int32_t *inode)
+{
+  uint32_t i;
+  *entry = -1;
+  *inode = -1;
+
+  while(1)
   {
-    if(setBit) thisInode.attribute |= (1 << READONLY_ATTR);
-    else thisInode.attribute &= ~(1 << READONLY_ATTR);
+    for(i = 0; i < NUM_FILES && *entry == -1; i++)
+      if(directory[i].in_use == 0) *entry = i;
+
+    *inode = findFreeInode();
+    if(*entry != -1 && *inode != -1) break;
+
+    if(growDirectory() != FS_OK) return FS_ENFILE;
+    *entry = -1;
   }
 
-  //Save inode changes
-  inodes[thisFile.inode] = thisInode;
+  //A deleted file's pointer blocks may have gone to other files since, but it keeps them for
+  //undelete unless the new file is committed
+  memcpy(reserved_disk, inodes[*inode].disk, diskInodeSize());
+  clearMap(&inodes[*inode]);
+  return FS_OK;
+}
+
+//Give back the inode of a file reserved with reserveFile that won't be committed, leaving any
+//deleted file that pointed from it as it was
+void cancelFile(int32_t inode)
+{
+  restoreInode(inode, reserved_disk);
+}
+
+//Claim a reserved directory entry and inode for a file named name in directory parent, whose
+//blocks are already in place
+void commitEntry(int32_t entry, int32_t inode, uint32_t parent, char *name, uint32_t size)
+{
+  //Set the inode to in use and not free
+  free_inodes[inode] = 0;
+  markDirty(&free_inodes[inode], 1);
+  inodes[inode].in_use = 1;
+  inodes[inode].attribute = 0;
+  inodes[inode].file_size = size;
+  storeInode(&inodes[inode]);
+
+  //place file info in the directory, replacing any deleted file in the entry
+  if(directory[entry].filename[0] != '\0') nameRemove(entry);
+  directory[entry].in_use = 1;
+  directory[entry].inode = inode;
+  memset(directory[entry].filename, 0, 64);
+  strncpy(directory[entry].filename, name, 63);
+  nameAdd(entry, parent);
+  markDirty(&directory[entry], sizeof(struct directoryEntry));
 }
 
-//List files within the opened FS image
-//-a to include current file attribute state
-//-h to include hidden files among listed files
-void list(char *param1,char *param2)
+//Claim a reserved directory entry and inode for a file at filename, a path in images with
+//directories, whose blocks are already in place. The caller checks the name, see checkNewName
+void commitFile(int32_t entry, int32_t inode, char *filename, uint32_t size)
 {
-  int32_t i, j, not_found = 1;
-  uint32_t hidden = 0, print_attr = 0;
+  uint32_t parent = ROOT_DIR;
+  if(treeDirs()) parent = walkPath(filename, &filename);
+  commitEntry(entry, inode, parent, filename, size);
+}
 
-  if(param1[1] == 'h' || param2[1] == 'h') hidden = 1;
-  if(param1[1] == 'a' || param2[1] == 'a') print_attr = 1;
+//Copy the input into newly claimed blocks of the inode, appending block pointers at a cursor
+//size is the input length if known, or -1 to read until end of input
+//Returns the number of bytes stored, or -1 after releasing everything claimed
+int64_t streamIn(int fd, uint32_t inode, int64_t size)
+{
+  uint32_t cursor = 0, start, len, i;
+  int64_t stored = 0;
+  ssize_t n;
 
-  printf("Contents of image: %s\n",image_name);
+  //A known size gets all of its blocks reserved in as few runs as possible
+  if(size >= 0) allocFileBlocks(inode, 0, blocksFor(size));
 
-  for(i = 0; i < NUM_FILES; i++)
+  while(1)
   {
-    if( directory[i].in_use)
+    struct extent ext;
+    if(size >= 0)
     {
-      if(!hidden && (inodes[directory[i].inode].attribute) & (1 << HIDDEN_ATTR))
-        continue;
-      
-      not_found=0;
-      char filename[64];
-      
-      memset(filename, 0, 64);
-      strncpy(filename, directory[i].filename, strlen(directory[i].filename));
-
-      if(print_attr)
+      if(stored == size) break;
+      nextExtent(&inodes[inode], cursor, blocksFor(size - stored), &ext);
+    }
+    else
+    {
+      //Input past the last block means the file is too big
+      if(cursor == sb.blocks_per_file)
+      {
+        uint8_t probe;
+        if(readFully(fd, &probe, 1) == 0) break;
+        fsError("File exceeds max filesize\n");
+        goto fail;
+      }
+
+      len = sb.blocks_per_file - cursor;
+      if(len > STREAM_RUN_BLOCKS) len = STREAM_RUN_BLOCKS;
+
+      //Leave room for the blocks of pointers the run could need
+      if(free_block_count < mapBlocksFor(cursor + len) - mapBlocksFor(cursor)) len = 0;
+      else len = findFreeRun(len, &start);
+      if(len == 0)
+      {
+        fsError("Not enough free space\n");
+        goto fail;
+      }
+      for(i = 0; i < len; i++)
+        claimBlock(start + i);
+
+      ext.start = start;
+      ext.length = len;
+    }
+
+    //One large read straight into the run
+    uint8_t *block = pinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length, 1);
+    size_t want = (size_t)ext.length * BLOCK_SIZE;
+    if(size >= 0 && want > size - stored) want = size - stored;
+
+    n = block == NULL ? -1 : readFully(fd, block, want);
+    if(n != -1) markDirty(block, n);
+    if(block != NULL) unpinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length);
+
+    if(n == -1 || (size >= 0 && (size_t)n < want))
+    {
+      if(block == NULL) fsError("Unable to read image %s: %s\n", image_name, strerror(errno));
+      else fsError("An error occured reading from the input file.\n");
+      if(size >= 0) cursor = blocksFor(size);
+      else
+      {
+        for(i = 0; i < ext.length; i++)
+          releaseBlock(ext.start + i);
+      }
+      goto fail;
+    }
+    stored += n;
+
+    if(size >= 0)
+    {
+      cursor += ext.length;
+      continue;
+    }
+
+    //Hand back the part of the run the input didn't fill, then point the file at the rest
+    uint32_t used = blocksFor(n);
+    for(i = used; i < ext.length; i++)
+      releaseBlock(ext.start + i);
+    for(i = 0; i < used; i++, cursor++)
+    {
+      if(setFileBlock(&inodes[inode], cursor, ext.start + i) == -1)
       {
-        printf("%s - Attr: ",filename);
-        for(j=7; j>=0; j--)
-        {
-          if((inodes[directory[i].inode].attribute) & (1 << j)) printf("1");
-          else printf("0");
-        }
-        printf("\n");
+        fsError("Not enough free space\n");
+        for(; i < used; i++)
+          releaseBlock(ext.start + i);
+        goto fail;
       }
-      else printf("%s\n",filename);
     }
+
+    if((size_t)n < want) break;
   }
 
-  if(not_found) printf("Error: No files found\n");
+  return stored;
+
+fail:
+  releaseFileBlocks(&inodes[inode], cursor);
+  return -1;
 }
 
-//Copy specified file from image to the current directory
-//May optionally specify a new filename for the created file
-void retrieve(char *fileToRetrieve, char *newFilename)
+//Insert file into the open FS image, optionally stored under a different name
+//A source of - reads from stdin, and pipes or other inputs without a size are read until they end
+//compress stores it packed, which also lets files past MAX_FILE_SIZE in if they compress enough
+void insert(char *source, char *filename, uint8_t compress)
 {
-  int32_t file_num = fileExists(fileToRetrieve);
-
-  if(file_num == -1)
+  if(!image_open)
   {
-    printf("Error: Filename %s not found\n",fileToRetrieve);
+    fsError("No image open\n");
     return;
   }
 
-  //If no new filename specified, use the current name
-  if(newFilename == NULL) newFilename = fileToRetrieve;
+  if(filename == NULL) filename = source;
+  if(strcmp(source, "-") == 0 && filename == source)
+  {
+    fsError("A name is needed to insert from stdin. Ex: insert - <filename>\n");
+    return;
+  }
 
-  fp = fopen(newFilename,"w");
+  //verify file exists
+  struct stat buf;
+  int fd = strcmp(source, "-") == 0 ? STDIN_FILENO : open(source, O_RDONLY);
 
-  struct directoryEntry thisFile = directory[file_num];
-  struct inode thisInode = inodes[thisFile.inode];
+  if(fd == -1 || fstat(fd, &buf) == -1)
+  {
+    fsError("File %s doesn't exist\n", source);
+    return;
+  }
 
-  uint32_t fileSize, block_count, i, j;
-  
-  fileSize = thisInode.file_size;
-  block_count = fileSize / BLOCK_SIZE;
+  //Only regular files report a size that can be trusted
+  int64_t size = -1;
+  if(S_ISREG(buf.st_mode) && buf.st_size > 0) size = buf.st_size;
 
-  //Filesize will be zero, within one block, or over multiple blocks
-  if(block_count < 1)
+  //Reading the input happens with the tables locked, other commands wait for the insert
+  pthread_rwlock_wrlock(&meta_lock);
+  if(!image_open)
   {
-    fwrite(&data[FIRST_DATA_BLOCK + thisInode.blocks[0]][0], 1, fileSize, fp);
+    fsError("No image open\n");
+    goto out;
   }
-  else
+
+  //verify file isnt too big
+  if(size > (int64_t)(compress ? UINT32_MAX : MAX_FILE_SIZE))
   {
-    for(i=0; i<block_count; i++)
-      fwrite(&data[ FIRST_DATA_BLOCK + thisInode.blocks[i]][0], BLOCK_SIZE, 1, fp);
-    
-    //In case last block is not full
-    uint32_t remainder = fileSize % BLOCK_SIZE;
-    if(remainder) fwrite(&data[ FIRST_DATA_BLOCK + thisInode.blocks[block_count]][0], 1, remainder, fp);
+    fsError("File exceeds max filesize\n");
+    goto out;
   }
 
-  fclose(fp);
-}
+  //verify there's enough space
+  if(!compress && size >= 0 && blocksFor(size) + mapBlocksFor(blocksFor(size)) > free_block_count)
+  {
+    fsError("Not enough free space\n");
+    goto out;
+  }
 
-//Used to initialize newly created FS image
-void init()
-{
-  directory = (struct directoryEntry *)&data[0][0];
-  free_inodes = (uint8_t *)&data[18][0];
-  free_blocks = (uint8_t *)&data[19][0];
-  inodes = (struct inode *)&data[84][0];
+  //In images with directories the name is a path, and one left out puts the file in the current
+  //directory under the last part of the source's
+  if(treeDirs())
+  {
+    if(filename == source) filename = baseName(source);
+    int ret = checkNewName(filename);
+    if(ret == FS_EEXIST) fsError("File %s already exists\n", filename);
+    else if(ret == FS_ENOENT) fsError("Directory of %s doesn't exist\n", filename);
+    else if(ret == FS_EINVAL) fsError("%s can't be used as a filename\n", filename);
+    if(ret != FS_OK) goto out;
+  }
 
-  memset(image_name, 0, 64);
+  int32_t directory_entry, inode_index;
+  int ret = reserveFile(&directory_entry, &inode_index);
+  if(ret != FS_OK)
+  {
+    if(directory_entry == -1) fsError("No empty directory entries available\n");
+    else fsError("No free inode\n");
+    goto out;
+  }
 
-  image_open = 0;
+  if(size >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-  uint32_t i,j;
-  for(i = 0; i < NUM_FILES; i++)
+  //Copy the data first so a failed read leaves the directory untouched
+  int64_t stored = compress ? packIn(fd, inode_index) : streamIn(fd, inode_index, size);
+  if(stored == -1)
   {
-    directory[i].in_use = 0;
-    directory[i].inode = -1;
-    free_inodes[i] = 1;
-
-    memset(directory[i].filename, 0, 64);
+    cancelFile(inode_index);
+    goto out;
+  }
 
-    for(j = 0; j < NUM_BLOCKS; j++)
-    {
-      inodes[i].blocks[j] = -1;
-      inodes[i].in_use = 0;
-      inodes[i].attribute = 0;
-      inodes[i].file_size = 0;
-    }
+  commitFile(directory_entry, inode_index, filename, stored);
+  if(compress)
+  {
+    inodes[inode_index].attribute = 1 << COMPRESSED_ATTR;
+    storeInode(&inodes[inode_index]);
   }
+  if(sb.features & FS_FEATURE_DEDUP) dedupFile(inode_index);
 
-  for(j = 0; j < NUM_BLOCKS; j++)
-    free_blocks[j] = 1;
+out:
+  pthread_rwlock_unlock(&meta_lock);
+  if(fd != STDIN_FILENO) close(fd);
 }
 
-//Print total data free in the open image
-uint32_t df()
-{
-  uint32_t j, count=0;
-  for(j = 0; j < NUM_BLOCKS; j++)
-    if(free_blocks[j]) count++;
-  
-  return count * BLOCK_SIZE;
-}
+//----------Bulk insert----------
+//One source file of insert-many. Everything it needs in the image is claimed before the
+//workers start, so they only copy data into their own blocks and take no locks.
+struct bulkJob {
+  char    *path;
+  char    *name;
+  int64_t  size;
+  int32_t  entry;
+  int32_t  inode;
+  int      status;  //0, or the errno of a failed read
+};
 
-//Create new FS image with specified file name
-void createfs(char *filename)
+struct bulkPool {
+  struct bulkJob *jobs;
+  uint32_t        count;
+  uint32_t        next;
+};
+
+//Workers take the next unclaimed job until none are left
+void *bulkWorker(void *arg)
 {
-  fp = fopen(filename, "w");
+  struct bulkPool *pool = arg;
+  uint32_t j;
 
-  strncpy(image_name, filename, strlen(filename));
+  while((j = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+  {
+    struct bulkJob *job = &pool->jobs[j];
+    if(job->entry == -1) continue;
 
-  memset(data, 0, NUM_BLOCKS * BLOCK_SIZE);
+    int fd = open(job->path, O_RDONLY);
+    if(fd == -1)
+    {
+      job->status = errno;
+      continue;
+    }
 
-  image_open = 1;
+    //Have the kernel read ahead the whole file so it comes in while earlier runs are copied
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
 
-  uint32_t i, j;
+    struct inode *thisInode = &inodes[job->inode];
+    struct extent ext;
+    uint32_t i;
+    int64_t stored = 0;
 
-  for(i = 0; i < NUM_FILES; i++)
-  {
-    directory[i].in_use = 0;
-    directory[i].inode = -1;
-    free_inodes[i] = 1;
+    for(i = 0; stored < job->size; i += ext.length)
+    {
+      nextExtent(thisInode, i, blocksFor(job->size - stored), &ext);
 
-    memset( directory[i].filename, 0, 64);
+      uint8_t *block = pinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length, 1);
+      size_t want = (size_t)ext.length * BLOCK_SIZE;
+      if(want > job->size - stored) want = job->size - stored;
 
-    for(j = 0; j < NUM_BLOCKS; j++)
-    {
-      inodes[i].blocks[j] = -1;
-      inodes[i].in_use = 0;
-      inodes[i].attribute = 0;
-      inodes[i].file_size = 0;
+      ssize_t n = block == NULL ? -1 : readFully(fd, block, want);
+      if(n != -1) markDirty(block, n);
+      if(block != NULL) unpinBlocks(FIRST_DATA_BLOCK + ext.start, ext.length);
+
+      if(n == -1 || (size_t)n < want)
+      {
+        job->status = n == -1 ? errno : EIO;
+        break;
+      }
+      stored += n;
     }
+
+    close(fd);
   }
 
-  for(j = 0; j < NUM_BLOCKS; j++ ) 
-    free_blocks[j] = 1;
-  
-  fclose(fp);
+  return NULL;
 }
 
-//Save changes to the open image
-void savefs()
+//Add a source to the job list, or to the list for one at a time insert if it has no fixed size
+void addBulkSource(char *path, char *name, struct bulkJob **jobs, uint32_t *count,
+                   char ***serial, uint32_t *serial_count)
 {
-  if(image_open == 0)
+  struct stat buf;
+  if(stat(path, &buf) == -1)
   {
-    printf("Error: No image open to be saved\n");
+    fsError("File %s doesn't exist\n", path);
     return;
   }
+  if(S_ISDIR(buf.st_mode)) return;
 
-  fp = fopen(image_name, "w");
-
-  fwrite(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
-
-  printf("Saved image: %s\n",image_name);
-  
-  fclose(fp);
-}
-
-//To open or change the current open FS image
-//Does not verify that the specified file is a valid FS image
-void openfs(char *filename)
-{
-  fp = fopen(filename, "r");
-
-  memset(image_name, 0, 64);
-  strncpy(image_name, filename, strlen(filename));
-  
-  fread(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
-
-  image_open = 1;
-
-  fclose(fp);
-}
-
-//Close the opened image if there's one
-//Does not save changes if any
-void closefs()
-{
-  if(image_open == 0) 
+  if(!S_ISREG(buf.st_mode))
   {
-    printf("Error: Disk image not open\n");
+    *serial = realloc(*serial, (*serial_count + 1) * 2 * sizeof(char *));
+    (*serial)[*serial_count * 2] = strdup(path);
+    (*serial)[*serial_count * 2 + 1] = strdup(name);
+    (*serial_count)++;
     return;
   }
 
-  image_open = 0;
-  memset(image_name, 0, 64);
+  *jobs = realloc(*jobs, (*count + 1) * sizeof(struct bulkJob));
+  struct bulkJob *job = &(*jobs)[(*count)++];
+  job->path = strdup(path);
+  job->name = strdup(name);
+  job->size = buf.st_size;
+  job->entry = -1;
+  job->inode = -1;
+  job->status = 0;
 }
 
-//Insert file into the open FS image
-void insert(char *filename)
+//Insert every file of a directory, stored under their own names, or every path listed one per
+//line in a file, stored like insert would. Regular files are copied by up to threads workers,
+//0 for one per CPU. Pipes and other inputs without a size are inserted one at a time after them.
+void insertMany(char *source, uint32_t threads)
 {
+  struct bulkJob *jobs = NULL;
+  char **serial = NULL;
+  uint8_t *saved = NULL;
+  uint32_t count = 0, serial_count = 0, i;
+
   if(!image_open)
   {
-    printf("Error: No image open\n");
+    fsError("No image open\n");
     return;
   }
 
-  //verify file exists
   struct stat buf;
-  int32_t ret = stat(filename, &buf);
-
-  if(ret == -1)
+  if(stat(source, &buf) == -1)
   {
-    printf("Error: File %s doesn't exist\n", filename);
+    fsError("File %s doesn't exist\n", source);
     return;
   }
 
-  //verify file isnt too big
-  if(buf.st_size > MAX_FILE_SIZE)
+  if(S_ISDIR(buf.st_mode))
   {
-    printf("Error: File exceeds max filesize\n");
-    return;
-  }
+    DIR *dir = opendir(source);
+    if(dir == NULL)
+    {
+      fsError("Unable to read directory %s: %s\n", source, strerror(errno));
+      return;
+    }
 
-  //verify there's enough space
-  if(buf.st_size > df())
-  {
-    printf("Error: Not enough free space\n");
-    return;
+    struct dirent *ent;
+    char path[PATH_MAX];
+    while((ent = readdir(dir)) != NULL)
+    {
+      if(ent->d_name[0] == '.') continue;
+      snprintf(path, sizeof(path), "%s/%s", source, ent->d_name);
+      addBulkSource(path, ent->d_name, &jobs, &count, &serial, &serial_count);
+    }
+    closedir(dir);
   }
-
-  //find empty directory entry
-  uint32_t i;
-  int32_t directory_entry = -1;
-  for(i = 0; i < NUM_FILES; i++)
+  else
   {
-    if(directory[i].in_use == 0)
+    FILE *list = fopen(source, "r");
+    if(list == NULL)
     {
-      directory_entry = i;
-      break;
+      fsError("Unable to open %s: %s\n", source, strerror(errno));
+      return;
     }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while((len = getline(&line, &line_size, list)) != -1)
+    {
+      if(len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+      if(len == 0) continue;
+      //Paths on the host go in the current directory of an image with directories
+      addBulkSource(line, treeDirs() ? baseName(line) : line, &jobs, &count, &serial, &serial_count);
+    }
+    free(line);
+    fclose(list);
   }
 
-  if(directory_entry == -1)
+  pthread_rwlock_wrlock(&meta_lock);
+  if(!image_open)
   {
-    printf("Error: No empty directory entries available\n");
-    return;
+    fsError("No image open\n");
+    goto out;
   }
 
-  //find free inodes and place the file
-  //-------Code from block_copy----------
-  // Open the input file read-only 
-  FILE *ifp = fopen (filename, "r");
-
-  // Save off the size of the input file since we'll use it in a couple of places and 
-  // also initialize our index variables to zero. 
-  int32_t copy_size   = buf.st_size;
-
-  // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-  // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-  // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-  int32_t offset      = 0;
-
-  // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-  // memory pool. Why? We are simulating the way the file system stores file data in
-  // blocks of space on the disk. block_index will keep us pointing to the area of
-  // the area that we will read from or write to.
-  int32_t block_index = -1;
-
-  //find a free inode
-  int32_t inode_index = findFreeInode();
-  
-  if(inode_index == -1)
+  //The inodes as they were, for any deleted file a failed job's inode still holds for undelete
+  saved = malloc((size_t)count * diskInodeSize());
+  if(saved == NULL && count > 0)
   {
-    printf("Error: No free inode\n");
-    return;
+    fsError("Not enough memory to insert %s\n", source);
+    goto out;
   }
 
-  //Set the inode to in use and not free
-  free_inodes[inode_index] = 0;
-  inodes[inode_index].in_use = 1;
-
-  //place file info in the directory
-  directory[directory_entry].in_use = 1;
-  directory[directory_entry].inode = inode_index;
-  strncpy(directory[directory_entry].filename, filename, strlen(filename));
-  //strcpy(directory[directory_entry].filename , filename);
-
-  inodes[inode_index].file_size = copy_size;
-
-  // copy_size is initialized to the size of the input file so each loop iteration we
-  // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-  // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-  // we have copied all the data from the input file.
-  while(copy_size > 0)
+  //Claim entries, inodes and blocks for the whole batch in one pass
+  int32_t entry = 0, inode = 0;
+  for(i = 0; i < count; i++)
   {
-    fseek(ifp, offset, SEEK_SET);
-
-    // Read BLOCK_SIZE number of bytes from the input file and store them in our
-    // data array.
+    struct bulkJob *job = &jobs[i];
 
-    //find a free block
-    block_index = findFreeBlock();
+    if(job->size > MAX_FILE_SIZE)
+    {
+      fsError("File %s exceeds max filesize\n", job->path);
+      continue;
+    }
+    if(blocksFor(job->size) + mapBlocksFor(blocksFor(job->size)) > free_block_count)
+    {
+      fsError("Not enough free space for %s\n", job->path);
+      continue;
+    }
 
-    if(block_index == -1)
+    while(1)
     {
-      printf("Error: No free blocks\n");
-      return;
+      while(entry < NUM_FILES && directory[entry].in_use) entry++;
+      while(inode < NUM_FILES && !free_inodes[inode]) inode++;
+      if((entry < NUM_FILES && inode < NUM_FILES) || growDirectory() != FS_OK) break;
+    }
+    if(entry == NUM_FILES || inode == NUM_FILES)
+    {
+      fsError("No free directory entry or inode for %s\n", job->path);
+      continue;
     }
 
-    int32_t bytes = fread(data[block_index + FIRST_DATA_BLOCK], BLOCK_SIZE, 1, ifp);
+    job->entry = entry++;
+    job->inode = inode++;
+    memcpy(saved + (size_t)i * diskInodeSize(), inodes[job->inode].disk, diskInodeSize());
+    clearMap(&inodes[job->inode]);
+    allocFileBlocks(job->inode, 0, blocksFor(job->size));
+  }
+
+  if(threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads > MAX_INSERT_THREADS) threads = MAX_INSERT_THREADS;
+  if(threads > count) threads = count;
 
-    //save the block number in the inode block[]
-    int32_t inode_block_index = findFreeInodeBlock(inode_index);
-    inodes[inode_index].blocks[inode_block_index] = block_index;
+  struct bulkPool pool = { jobs, count, 0 };
+  pthread_t workers[MAX_INSERT_THREADS];
+  uint32_t started = 0;
 
-    free_blocks[block_index] = 0; 
+  //Run on this thread as well, so a failed thread start only costs parallelism
+  for(started = 0; started + 1 < threads; started++)
+    if(pthread_create(&workers[started], NULL, bulkWorker, &pool) != 0) break;
+  bulkWorker(&pool);
+  for(i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
 
-    // If bytes == 0 and we haven't reached the end of the file then something is 
-    // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-    // It means we've reached the end of our input file.
-    if(bytes == 0 && !feof(ifp))
+  //Commit in input order, handing back the blocks of anything that failed
+  for(i = 0; i < count; i++)
+  {
+    struct bulkJob *job = &jobs[i];
+    if(job->entry == -1) continue;
+
+    int ret = treeDirs() ? checkNewName(job->name) : FS_OK;
+    if(ret == FS_OK && job->status == 0)
     {
-      printf("An error occured reading from the input file.\n");
-      return;
+      commitFile(job->entry, job->inode, job->name, job->size);
+      if(sb.features & FS_FEATURE_DEDUP) dedupFile(job->inode);
+      continue;
     }
 
-    // Clear the EOF file flag.
-    clearerr(ifp);
+    if(ret == FS_EEXIST) fsError("File %s already exists\n", job->name);
+    else if(ret != FS_OK) fsError("%s can't be used as a filename\n", job->name);
+    else fsError("An error occured reading %s: %s\n", job->path, strerror(job->status));
+    releaseFileBlocks(&inodes[job->inode], blocksFor(job->size));
+    restoreInode(job->inode, saved + (size_t)i * diskInodeSize());
+  }
+
+out:
+  pthread_rwlock_unlock(&meta_lock);
 
-    // Reduce copy_size by the BLOCK_SIZE bytes.
-    copy_size -= BLOCK_SIZE;
-    
-    // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-    // the fseek at the top of the loop to position us to the correct spot.
-    offset    += BLOCK_SIZE;
+  for(i = 0; i < serial_count; i++)
+    insert(serial[i * 2], serial[i * 2 + 1], 0);
 
-    // Increment the index into the block array 
-    // DO NOT just increment block index in your file 
-    
-    block_index = findFreeBlock();
+  for(i = 0; i < count; i++)
+  {
+    free(jobs[i].path);
+    free(jobs[i].name);
   }
-  // We are done copying from the input file so close it out.
-  fclose(ifp);
-}
\ No newline at end of file
+  for(i = 0; i < serial_count * 2; i++)
+    free(serial[i]);
+  free(jobs);
+  free(serial);
+  free(saved);
+}
@@ -0,0 +1,399 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Trevor Bakker
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../include/headers.h"
+#include "../include/libfs.h"
+
+//Handles carry the generation of the image they were opened on, so handles
+//left over from a closed image are refused instead of touching another one
+struct fs_image {
+  uint32_t generation;
+};
+
+struct fs_file {
+  uint32_t generation;
+  int32_t  entry;
+  int32_t  inode;
+  int      flags;
+};
+
+static struct fs_image the_image;
+static uint32_t        generation;
+static uint8_t         initialized;
+
+static const char *error_text[] = {
+  "Success",
+  "No such file",
+  "File already exists",
+  "No space left in image",
+  "No free directory entry or inode",
+  "File too large",
+  "File is read only",
+  "Bad file handle",
+  "Invalid argument",
+  "I/O error on image file",
+  "An image is already open",
+  "No image open",
+  "Out of memory",
+  "Not a valid image",
+  "Data failed its checksum",
+};
+
+//Check that img is the open image
+static int checkImage(fs_image *img)
+{
+  if(img == NULL) return FS_EINVAL;
+  if(!image_open || img != &the_image || img->generation != generation) return FS_ENOIMG;
+  return FS_OK;
+}
+
+//Check that file still refers to an open file of the current image
+static int checkFile(fs_file *file)
+{
+  if(file == NULL) return FS_EINVAL;
+  if(!image_open || file->generation != generation) return FS_EBADF;
+  if(directory[file->entry].in_use != 1 || directory[file->entry].inode != file->inode) return FS_EBADF;
+  return FS_OK;
+}
+
+//Caller holds meta_lock, the size can still change under a shared one
+static void fillStat(int32_t entry, struct fs_stat *st)
+{
+  int32_t inode = directory[entry].inode;
+  struct inode *thisInode = &inodes[inode];
+
+  memcpy(st->name, directory[entry].filename, 64);
+  st->name[63] = '\0';
+  st->inode = inode;
+
+  pthread_rwlock_rdlock(&inode_locks[inode]);
+  st->size = thisInode->file_size;
+  st->attribute = thisInode->attribute;
+  pthread_rwlock_unlock(&inode_locks[inode]);
+}
+
+//Open, or with FS_IMAGE_CREATE create, the image at path. Zero sizes take the defaults
+static int openImage(const char *path, int flags, uint32_t block_size, uint32_t num_blocks,
+                     uint32_t num_files, fs_image **img)
+{
+  int ret;
+
+  if(path == NULL || img == NULL || strlen(path) >= 64) return FS_EINVAL;
+
+  pthread_rwlock_wrlock(&meta_lock);
+  if(image_open)
+  {
+    pthread_rwlock_unlock(&meta_lock);
+    return FS_EBUSY;
+  }
+
+  if(!initialized)
+  {
+    init();
+    initialized = 1;
+  }
+
+  if(flags & FS_IMAGE_CREATE)
+  {
+    //Like createfs the image is only written by the first save, unless it is mapped
+    ret = formatImage((char *)path, block_size, num_blocks, num_files);
+    if(ret == FS_OK && (flags & FS_IMAGE_MMAP)) ret = mapImage((char *)path);
+    else if(ret == FS_OK && (flags & FS_IMAGE_POOL)) ret = poolImage((char *)path, DEFAULT_POOL_SIZE);
+  }
+  else if(flags & FS_IMAGE_MMAP) ret = mapImage((char *)path);
+  else if(flags & FS_IMAGE_POOL) ret = poolImage((char *)path, DEFAULT_POOL_SIZE);
+  else ret = loadImage((char *)path);
+
+  if(ret != FS_OK) closeImage();
+  else
+  {
+    the_image.generation = ++generation;
+    *img = &the_image;
+  }
+
+  pthread_rwlock_unlock(&meta_lock);
+  return ret;
+}
+
+int fs_open_image(const char *path, int flags, fs_image **img)
+{
+  return openImage(path, flags, 0, 0, 0, img);
+}
+
+int fs_create_image(const char *path, uint32_t block_size, uint32_t num_blocks, uint32_t num_files,
+                    int flags, fs_image **img)
+{
+  return openImage(path, flags | FS_IMAGE_CREATE, block_size, num_blocks, num_files, img);
+}
+
+int fs_save_image(fs_image *img)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+  int ret = checkImage(img);
+  if(ret == FS_OK) ret = saveImage();
+  pthread_rwlock_unlock(&meta_lock);
+
+  return ret;
+}
+
+//Closes without saving, except for mapped images which write through
+//File handles opened on the image become stale and only fs_close accepts them
+int fs_close_image(fs_image *img)
+{
+  pthread_rwlock_wrlock(&meta_lock);
+  int ret = checkImage(img);
+  if(ret == FS_OK)
+  {
+    generation++;
+    ret = closeImage();
+  }
+  pthread_rwlock_unlock(&meta_lock);
+
+  return ret;
+}
+
+int fs_open(fs_image *img, const char *name, int flags, fs_file **file)
+{
+  if(name == NULL || file == NULL || name[0] == '\0' || strlen(baseName((char *)name)) >= 64) return FS_EINVAL;
+
+  fs_file *f = malloc(sizeof(fs_file));
+  if(f == NULL) return FS_ENOMEM;
+
+  //Only creating a file changes the tables
+  if(flags & FS_O_CREAT) pthread_rwlock_wrlock(&meta_lock);
+  else pthread_rwlock_rdlock(&meta_lock);
+
+  int32_t entry = -1, inode;
+  int ret = checkImage(img);
+  if(ret != FS_OK) goto out;
+
+  //Directories have no data to open
+  entry = findEntry((char *)name, 1);
+  if(entry != -1 && isDirectory(entry))
+  {
+    ret = FS_EINVAL;
+    goto out;
+  }
+  if(entry == -1)
+  {
+    ret = FS_ENOENT;
+    if(!(flags & FS_O_CREAT)) goto out;
+
+    ret = checkNewName((char *)name);
+    if(ret == FS_OK) ret = reserveFile(&entry, &inode);
+    if(ret != FS_OK) goto out;
+
+    commitFile(entry, inode, (char *)name, 0);
+    flags |= FS_O_RDWR;
+  }
+
+  f->generation = generation;
+  f->entry = entry;
+  f->inode = directory[entry].inode;
+  f->flags = flags;
+  *file = f;
+
+out:
+  pthread_rwlock_unlock(&meta_lock);
+  if(ret != FS_OK) free(f);
+  return ret;
+}
+
+//Returns the number of bytes read, 0 at or past the end of the file, or an error code
+//Compressed files are decompressed as they are read, FS_EBADIMG if that fails
+ssize_t fs_pread(fs_file *file, void *buf, size_t len, uint32_t offset)
+{
+  if(buf == NULL && len > 0) return FS_EINVAL;
+
+  pthread_rwlock_rdlock(&meta_lock);
+  int ret = checkFile(file);
+  if(ret != FS_OK)
+  {
+    pthread_rwlock_unlock(&meta_lock);
+    return ret;
+  }
+
+  pthread_rwlock_rdlock(&inode_locks[file->inode]);
+
+  struct inode *thisInode = &inodes[file->inode];
+  if(offset >= thisInode->file_size) len = 0;
+  else if(len > thisInode->file_size - offset) len = thisInode->file_size - offset;
+
+  if(verifyBlocks(thisInode, offset, len) != -1) ret = FS_ECORRUPT;
+  else if(len && (thisInode->attribute & (1 << COMPRESSED_ATTR)))
+  {
+    if(unpackRange(thisInode, offset, buf, len) == -1) ret = FS_EBADIMG;
+  }
+  else if(len && copyFileData(thisInode, offset, buf, len, 0) == -1) ret = FS_EIO;
+
+  pthread_rwlock_unlock(&inode_locks[file->inode]);
+  pthread_rwlock_unlock(&meta_lock);
+  return ret == FS_OK ? (ssize_t)len : ret;
+}
+
+//Writes past the end grow the file, with any gap before offset reading back as zeros
+//Returns len or an error code, nothing is written on error but FS_EIO from a pooled image,
+//which can leave the write partly done
+ssize_t fs_pwrite(fs_file *file, const void *buf, size_t len, uint32_t offset)
+{
+  if(buf == NULL && len > 0) return FS_EINVAL;
+  if(len > MAX_FILE_SIZE || offset > MAX_FILE_SIZE - len) return FS_EFBIG;
+
+  //Writes to different files run side by side, only claiming blocks is serialized
+  pthread_rwlock_rdlock(&meta_lock);
+  int ret = checkFile(file);
+  if(ret == FS_OK && !(file->flags & FS_O_RDWR)) ret = FS_EBADF;
+  if(ret != FS_OK)
+  {
+    pthread_rwlock_unlock(&meta_lock);
+    return ret;
+  }
+
+  pthread_rwlock_wrlock(&inode_locks[file->inode]);
+
+  struct inode *thisInode = &inodes[file->inode];
+  uint32_t size = thisInode->file_size, end = offset + len;
+
+  //Compressed files are written whole by insert -c, not in place
+  if(thisInode->attribute & ((1 << READONLY_ATTR) | (1 << COMPRESSED_ATTR)))
+  {
+    ret = FS_EROFS;
+    goto out;
+  }
+  if(len == 0) goto out;
+
+  //Blocks shared with other files by dedup get a copy of their own before they change
+  uint32_t first = (offset < size ? offset : size) / BLOCK_SIZE, last = blocksFor(end < size ? end : size);
+  if(last > first)
+  {
+    ret = unshareBlocks(file->inode, first, last - first);
+    if(ret != FS_OK) goto out;
+  }
+
+  if(end > size)
+  {
+    uint32_t have = blocksFor(size), need = blocksFor(end);
+    ret = growFile(file->inode, have, need - have);
+    if(ret != FS_OK) goto out;
+
+    //Blocks come back with whatever a deleted file left in them
+    static const uint8_t zeros[4096];
+    uint32_t pos = size, n;
+    while(pos < offset)
+    {
+      n = offset - pos;
+      if(n > sizeof(zeros)) n = sizeof(zeros);
+      if(copyFileData(thisInode, pos, (uint8_t *)zeros, n, 1) == -1)
+      {
+        ret = FS_EIO;
+        goto out;
+      }
+      pos += n;
+    }
+
+    thisInode->file_size = end;
+    storeInode(thisInode);
+  }
+
+  if(copyFileData(thisInode, offset, (uint8_t *)buf, len, 1) == -1) ret = FS_EIO;
+
+out:
+  pthread_rwlock_unlock(&inode_locks[file->inode]);
+  pthread_rwlock_unlock(&meta_lock);
+  return ret == FS_OK ? (ssize_t)len : ret;
+}
+
+int fs_stat(fs_image *img, const char *name, struct fs_stat *st)
+{
+  if(name == NULL || st == NULL) return FS_EINVAL;
+
+  pthread_rwlock_rdlock(&meta_lock);
+  int ret = checkImage(img);
+  if(ret == FS_OK)
+  {
+    int32_t entry = findEntry((char *)name, 1);
+    if(entry == -1) ret = FS_ENOENT;
+    else fillStat(entry, st);
+  }
+  pthread_rwlock_unlock(&meta_lock);
+
+  return ret;
+}
+
+//Makes a directory at path, in images created with directories
+int fs_mkdir(fs_image *img, const char *path)
+{
+  if(path == NULL) return FS_EINVAL;
+
+  pthread_rwlock_wrlock(&meta_lock);
+  int ret = checkImage(img);
+  if(ret == FS_OK) ret = createDirectory((char *)path);
+  pthread_rwlock_unlock(&meta_lock);
+
+  return ret;
+}
+
+//Fills in the next file from *cursor on in directory path, the current one if it is empty,
+//including hidden files and directories. *cursor starts at 0 for each directory walked
+//Returns 1 with st filled in, 0 once every file has been seen, or an error code
+int fs_readdir(fs_image *img, const char *path, uint32_t *cursor, struct fs_stat *st)
+{
+  if(path == NULL || cursor == NULL || st == NULL) return FS_EINVAL;
+
+  pthread_rwlock_rdlock(&meta_lock);
+  int ret = checkImage(img);
+  if(ret == FS_OK)
+  {
+    int32_t entry;
+    ret = nextEntry((char *)path, cursor, &entry);
+    if(ret == FS_OK && entry != -1)
+    {
+      fillStat(entry, st);
+      ret = 1;
+    }
+  }
+  pthread_rwlock_unlock(&meta_lock);
+
+  return ret;
+}
+
+//Frees the handle, file data is only written to the image file by fs_save_image
+int fs_close(fs_file *file)
+{
+  if(file == NULL) return FS_EINVAL;
+
+  free(file);
+  return FS_OK;
+}
+
+const char *fs_strerror(int code)
+{
+  if(code > 0 || -code >= (int)(sizeof(error_text) / sizeof(error_text[0]))) return "Unknown error";
+  return error_text[-code];
+}
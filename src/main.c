@@ -0,0 +1,524 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Trevor Bakker
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "../include/headers.h"
+
+// Input handling
+#define WHITESPACE " \t\n"
+#define MAX_COMMAND_SIZE 255
+#define MAX_NUM_ARGUMENTS 12
+
+//Parse a byte offset or count into value. Returns 0, or -1 if arg isn't a number that fits
+int parseBytes(char *arg, uint32_t *value)
+{
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(arg, &end, 10);
+  if(arg[0] < '0' || arg[0] > '9' || *end != '\0' || errno == ERANGE || n > UINT32_MAX) return -1;
+
+  *value = n;
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *command_string = NULL;
+  size_t command_size = 0;
+  FILE *input = stdin;
+  uint8_t stop_on_error = 0;
+  char *error_text = NULL;
+  size_t error_text_len = 0;
+  int opt;
+
+  //-b <script> runs a command file, -e stops a batch at the first error
+  while((opt = getopt(argc, argv, "b:e")) != -1)
+  {
+    switch(opt)
+    {
+      case 'b':
+        batch_mode = 1;
+        if(strcmp(optarg, "-") != 0 && (input = fopen(optarg, "r")) == NULL)
+        {
+          fprintf(stderr, "Error: Unable to open script %s: %s\n", optarg, strerror(errno));
+          return 1;
+        }
+        break;
+      case 'e':
+        stop_on_error = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-b script|-] [-e]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  //Commands piped in are run as a batch too
+  if(!isatty(STDIN_FILENO)) batch_mode = 1;
+  if(batch_mode) error_log = open_memstream(&error_text, &error_text_len);
+
+  init();
+
+  while(1)
+  {
+//----------Input string handling----------
+    //Print out the prompt
+    if(!batch_mode) printf("FS> ");
+
+    if(stop_on_error && error_count) break;
+
+    //Wait for command to read
+    if(getline(&command_string, &command_size, input) == -1) break;
+    batch_line++;
+
+    //Parse input
+    char *token[MAX_NUM_ARGUMENTS];
+
+    uint32_t i, token_count = 0;
+    for(i = 0; i < MAX_NUM_ARGUMENTS; i++)
+      token[i] = NULL;
+    
+    char *argument_ptr = NULL;
+    char *working_string = command_string;
+
+    //Tokenize the input string in place with whitespace as delimiter
+    while(((argument_ptr = strsep(&working_string, WHITESPACE)) != NULL) &&
+           (token_count < MAX_NUM_ARGUMENTS))
+    {
+      if(*argument_ptr == '\0') continue;
+      token[token_count++] = argument_ptr;
+    }
+
+//----------Command handling----------
+
+    if(token[0] == NULL)
+      continue;
+
+    if(strcmp(token[0], "quit") == 0)
+      break;
+
+    if(strcmp("createfs", token[0]) == 0)
+    {
+      //-b <block size>, -n <blocks> and -i <most files> set the geometry, anything left out is the default
+      uint32_t geometry[3] = { 0, 0, 0 };
+      char **args = &token[1];
+      uint8_t bad = 0;
+
+      while(args[0] != NULL && args[0][0] == '-')
+      {
+        char *flags = "bni", *which = strchr(flags, args[0][1]);
+        if(which == NULL || args[0][1] == '\0' || args[0][2] != '\0' || args[1] == NULL || atol(args[1]) <= 0)
+        {
+          bad = 1;
+          break;
+        }
+        geometry[which - flags] = strtoul(args[1], NULL, 10);
+        args += 2;
+      }
+
+      if(bad)
+      {
+        fsError("Incorrect parameters. Ex: createfs [-b <block size>] [-n <blocks>] [-i <files>] <filename>\n");
+        continue;
+      }
+      if(args[0] == NULL)
+      {
+        fsError("No filename specified\n");
+        continue;
+      }
+      createfs(args[0], geometry[0], geometry[1], geometry[2]);
+    }
+    else if(strcmp("savefs", token[0]) == 0)
+    {
+      savefs();
+    }
+    else if( strcmp("open", token[0]) == 0)
+    {
+      if(token[1] == NULL)
+      {
+        fsError("No filename specified\n");
+        continue;
+      }
+      if(strcmp(token[1], "-m") == 0)
+      {
+        if(token[2] == NULL)
+        {
+          fsError("No filename specified\n");
+          continue;
+        }
+        openfs_mmap(token[2]);
+      }
+      //-p <MB> keeps only the tables and about MB megabytes of data in memory
+      else if(strcmp(token[1], "-p") == 0)
+      {
+        if(token[2] == NULL || atoi(token[2]) <= 0)
+        {
+          fsError("Expected a pool size in megabytes after -p\n");
+          continue;
+        }
+        if(token[3] == NULL)
+        {
+          fsError("No filename specified\n");
+          continue;
+        }
+        openfs_pool(token[3], atoi(token[2]));
+      }
+      else openfs(token[1]);
+    }
+    else if(strcmp("close", token[0]) == 0)
+    {
+      closefs();
+    }
+    else if(strcmp("list", token[0]) == 0)
+    {
+      if(!image_open)
+      {
+        fsError("No image open\n");
+        continue;
+      }
+      //-h and -a in any order, then the directory to list if not the current one
+      uint8_t hidden = 0, print_attr = 0;
+      char **args = &token[1];
+      while(args[0] != NULL && (strcmp(args[0], "-h") == 0 || strcmp(args[0], "-a") == 0))
+      {
+        if(args[0][1] == 'h') hidden = 1;
+        else print_attr = 1;
+        args++;
+      }
+
+      list(args[0] == NULL ? "" : args[0], hidden, print_attr);
+    }
+    else if(strcmp("df", token[0]) == 0)
+    {
+      if(!image_open)
+      {
+        fsError("No image open\n");
+        continue;
+      }
+      printf("%" PRIu64 " bytes free\n",df());
+
+      //Compressed files hold more data than the blocks they take
+      uint64_t stored, logical;
+      dfUsage(&stored, &logical);
+      printf("%" PRIu64 " bytes used by files holding %" PRIu64 " bytes\n", stored, logical);
+    }
+    else if(strcmp("insert", token[0]) == 0)
+    {
+      uint8_t compress = 0;
+      char **args = &token[1];
+
+      //-c stores the file compressed
+      if(args[0] != NULL && strcmp(args[0], "-c") == 0)
+      {
+        compress = 1;
+        args++;
+      }
+
+      if(args[0] == NULL)
+      {
+        fsError("No filename specified\n");
+        continue;
+      }
+      if(batch_mode && input == stdin && strcmp(args[0], "-") == 0)
+      {
+        fsError("Can't insert from stdin while it is carrying the commands\n");
+        continue;
+      }
+      insert(args[0], args[1], compress);
+    }
+    else if(strcmp("insert-many", token[0]) == 0)
+    {
+      uint32_t threads = 0;
+      char **args = &token[1];
+
+      //-j <n> sets the number of copying threads, one per CPU by default
+      if(args[0] != NULL && strcmp(args[0], "-j") == 0)
+      {
+        if(args[1] == NULL || atoi(args[1]) <= 0)
+        {
+          fsError("Expected a thread count after -j\n");
+          continue;
+        }
+        threads = atoi(args[1]);
+        args += 2;
+      }
+
+      if(args[0] == NULL)
+      {
+        fsError("No directory or list specified\n");
+        continue;
+      }
+      insertMany(args[0], threads);
+    }
+    else if(strcmp("dedup", token[0]) == 0)
+    {
+      setDedup(token[1]);
+    }
+    else if(strcmp("scrub", token[0]) == 0)
+    {
+      uint32_t threads = 0;
+
+      //-j <n> sets the number of checking threads, one per CPU by default
+      if(token[1] != NULL && strcmp(token[1], "-j") == 0)
+      {
+        if(token[2] == NULL || atoi(token[2]) <= 0)
+        {
+          fsError("Expected a thread count after -j\n");
+          continue;
+        }
+        threads = atoi(token[2]);
+      }
+      scrub(threads);
+    }
+    else if(strcmp("defrag", token[0]) == 0)
+    {
+      uint32_t i, seconds = 0, megabytes = 0;
+
+      //-t <seconds> and -b <MB> bound how long one run takes and how much it moves
+      for(i = 1; i + 1 < MAX_NUM_ARGUMENTS && token[i] != NULL; i += 2)
+      {
+        if(strcmp(token[i], "-t") != 0 && strcmp(token[i], "-b") != 0) break;
+        if(token[i + 1] == NULL || atoi(token[i + 1]) <= 0) break;
+        if(token[i][1] == 't') seconds = atoi(token[i + 1]);
+        else megabytes = atoi(token[i + 1]);
+      }
+      if(i < MAX_NUM_ARGUMENTS && token[i] != NULL)
+      {
+        fsError("Incorrect parameters. Ex: defrag [-t <seconds>] [-b <MB>]\n");
+        continue;
+      }
+      defrag(seconds, megabytes);
+    }
+    else if(strcmp("snapshot", token[0]) == 0)
+    {
+      //Without a name the snapshots are listed, -d <name> deletes one
+      if(token[1] == NULL) listSnapshots();
+      else if(strcmp(token[1], "-d") == 0)
+      {
+        if(token[2] == NULL)
+        {
+          fsError("No snapshot specified to delete\n");
+          continue;
+        }
+        deleteSnapshot(token[2]);
+      }
+      else snapshot(token[1]);
+    }
+    else if(strcmp("rollback", token[0]) == 0)
+    {
+      if(token[1] == NULL)
+      {
+        fsError("No snapshot specified to roll back to\n");
+        continue;
+      }
+      rollback(token[1]);
+    }
+    else if(strcmp("clone", token[0]) == 0)
+    {
+      if(token[1] == NULL || token[2] == NULL)
+      {
+        fsError("Incorrect parameters. Ex: clone <filename> <newfilename>\n");
+        continue;
+      }
+      cloneFile(token[1], token[2]);
+    }
+    else if(strcmp("read", token[0]) == 0)
+    {
+      uint32_t start, num;
+      uint8_t mode = READ_HEX;
+      char **args = &token[1];
+
+      //-x gives an xxd style dump, -r the raw bytes
+      if(args[0] != NULL && strcmp(args[0], "-x") == 0)
+      {
+        mode = READ_XXD;
+        args++;
+      }
+      else if(args[0] != NULL && strcmp(args[0], "-r") == 0)
+      {
+        mode = READ_RAW;
+        args++;
+      }
+
+      if(args[0] == NULL)
+      {
+        fsError("No filename specified\n");
+        continue;
+      }
+      if(!image_open)
+      {
+        fsError("No image open\n");
+        continue;
+      }
+
+      //If starting byte not provided, default to zero
+      if(args[1] == NULL) start = 0;
+      else if(parseBytes(args[1], &start) == -1)
+      {
+        fsError("Starting byte %s is not a valid offset\n", args[1]);
+        continue;
+      }
+
+      //If num bytes to read not provided, default to file size
+      if(args[2] == NULL)
+      {
+        int32_t ret = fileExists(args[0]);
+        if(ret == -1)
+        {
+          fsError("File %s doesn't exist\n",args[0]);
+          continue;
+        }
+        num = inodes[directory[ret].inode].file_size;
+      }
+      else if(parseBytes(args[2], &num) == -1)
+      {
+        fsError("Number of bytes %s is not a valid count\n", args[2]);
+        continue;
+      }
+
+      readData(args[0], start, num, mode);
+    }
+    else if(strcmp("attrib", token[0]) == 0)
+    {
+      int32_t fileIndex;
+      uint32_t i, j;
+      for(i = 1; i < MAX_NUM_ARGUMENTS; i++)
+      {
+        if(token[i] == NULL)
+        {
+          fsError("Incorrect parameters. Ex: attrib [+attribute] <filename>\n");
+          break;
+        }
+        else
+        {
+          if(token[i][0] == '+' || token[i][0] == '-')
+          {
+            continue;
+          }
+          else if((fileIndex = fileExists(token[i])) >=0)
+          {
+            for(j = i; j > 0; --j)
+              set_attribute(fileIndex, token[j]);
+            
+            break;
+          }
+          else
+          {
+            if(fileIndex < 0) fsError("File %s doesn't exist\n", token[i]);
+            else fsError("Incorrect param format\nEx: attrib [+attribute] [-attribute] <filename>\n");
+            break;
+          }
+        }
+      }
+    }
+    else if(strcmp("retrieve", token[0]) == 0)
+    {
+      if(token[1] == NULL)
+      {
+        fsError("No file specified to retrieve\n");
+        continue;
+      }
+      retrieve(token[1], token[2]);
+    }
+    else if(strcmp("encrypt", token[0]) == 0 || strcmp("decrypt", token[0]) == 0)
+    {
+      if(token[1] == NULL)
+      {
+        fsError("No file specified to encrypt\nEx: encrypt <filename> <cipher>\n");
+        continue;
+      }
+      if(token[2] == NULL)
+      {
+        fsError("No cipher specified\nEx: encrypt <filename> <cipher>\n");
+        continue;
+      }
+      if(strlen(token[2]) > MAX_KEY_SIZE)
+      {
+        fsError("Cipher is limited to %d bytes\n", MAX_KEY_SIZE);
+        continue;
+      }
+      encryptFile(token[1], (uint8_t *)token[2], strlen(token[2]));
+    }
+    else if(strcmp("delete", token[0]) == 0)
+    {
+      if(token[1] == NULL)
+      {
+        fsError("No file specified to delete\n");
+        continue;
+      }
+      deleteFile(token[1]);
+    }
+    else if(strcmp("undelete", token[0]) == 0)
+    {
+      if(token[1] == NULL)
+      {
+        fsError("No file specified to undelete\n");
+        continue;
+      }
+      undeleteFile(token[1]);
+    }
+    else if(strcmp("mkdir", token[0]) == 0)
+    {
+      if(token[1] == NULL)
+      {
+        fsError("No directory specified\n");
+        continue;
+      }
+      makeDirectory(token[1]);
+    }
+    else if(strcmp("cd", token[0]) == 0)
+    {
+      //Without a path cd goes back to the root
+      changeDirectory(token[1] == NULL ? "/" : token[1]);
+    }
+    else if(strcmp("pwd", token[0]) == 0)
+    {
+      printDirectory();
+    }
+    else fsError("Unsupported command %s\n",token[0]);
+  }
+
+  free(command_string);
+
+  if(batch_mode)
+  {
+    fflush(stdout);
+    fclose(error_log);
+    if(error_count)
+    {
+      fputs(error_text, stderr);
+      fprintf(stderr, "%u error(s) in %u line(s)\n", error_count, batch_line);
+    }
+    free(error_text);
+  }
+
+  return (batch_mode && error_count) ? 1 : 0;
+}